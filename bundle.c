@@ -0,0 +1,480 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <libgen.h>
+
+#include "flash32w.h"
+
+/*
+ * Bundle layout, all integers little endian:
+ *
+ *   header   magic "F32WBDL1", u32 count, u32 reserved
+ *   entry    u32 type, u32 addr, u32 offset, u32 size, sha256[32],
+ *            version[16], name[32]                        (count times)
+ *   data     images referenced by offset/size
+ */
+#define BUNDLE_MAGIC		"F32WBDL1"
+#define BUNDLE_HDR_SIZE		16
+#define BUNDLE_ENTRY_SIZE	96
+#define BUNDLE_MAX_ENTRIES	16
+
+#define BUNDLE_BRIDGE		1
+#define BUNDLE_APP		2
+#define BUNDLE_BLOB		3
+
+struct bundle_entry {
+	uint32_t type;
+	uint32_t addr;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t sha[32];
+	char version[16];
+	char name[32];
+	uint8_t *data;
+};
+
+static char *type_names[] = {NULL, "bridge", "app", "blob"};
+
+/* current content of pages only partly covered by the bundle */
+static uint8_t merged[FLASH_PAGES][FLASH_PAGE_SIZE];
+
+static uint32_t get_u32(uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void print_entry(struct bundle_entry *e)
+{
+	int i;
+
+	printf("%-6s %-20s %6u bytes", type_names[e->type], e->name, e->size);
+	if (e->type != BUNDLE_BRIDGE)
+		printf("  at 0x%08x", e->addr);
+	if (e->version[0])
+		printf("  version %s", e->version);
+	printf("  sha256 ");
+	for (i = 0; i < 8; i++)
+		printf("%02x", e->sha[i]);
+	printf("...");
+}
+
+static uint8_t *map_file(char *filename, uint32_t *size, int *fd)
+{
+	struct stat s;
+	uint8_t *data;
+
+	*fd = open(filename, O_RDONLY);
+	if (*fd < 0) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+	fstat(*fd, &s);
+	if ((s.st_size == 0) || ((data = mmap(NULL, s.st_size, PROT_READ,
+		MAP_PRIVATE, *fd, 0)) == MAP_FAILED)) {
+		printf("Cannot read file %s\n", filename);
+		exit(1);
+	}
+	*size = s.st_size;
+	return data;
+}
+
+/*
+ * Artifacts are given as bridge:file[:version], app:file[:addr[:version]]
+ * or blob:file:addr[:version], e.g.
+ * bridge:stm32f.bin:2.0.6 app:app.bin::1.4 blob:cfg.bin:0x0801b800
+ */
+int bundle_create(char *filename, int argc, char **argv)
+{
+	struct bundle_entry e[BUNDLE_MAX_ENTRIES];
+	uint8_t hdr[BUNDLE_HDR_SIZE + BUNDLE_MAX_ENTRIES * BUNDLE_ENTRY_SIZE];
+	char *s, *type, *file, *addr, *ver, *end, version[32];
+	uint32_t offset;
+	int i, fd, out;
+
+	if ((argc == 0) || (argc > BUNDLE_MAX_ENTRIES)) {
+		printf("Bundle needs 1 to %u artifacts\n", BUNDLE_MAX_ENTRIES);
+		exit(1);
+	}
+
+	offset = BUNDLE_HDR_SIZE + argc * BUNDLE_ENTRY_SIZE;
+	memset(e, 0, sizeof(e));
+	for (i = 0; i < argc; i++) {
+		s = argv[i];
+		type = strsep(&s, ":");
+		file = strsep(&s, ":");
+		addr = NULL;
+		if (file && strcmp(type, "bridge"))
+			addr = strsep(&s, ":");
+		ver = strsep(&s, ":");
+		if (!file || !file[0] || s) {
+			printf("Wrong artifact %s\n", argv[i]);
+			exit(1);
+		}
+		for (e[i].type = BUNDLE_BRIDGE; e[i].type <= BUNDLE_BLOB; e[i].type++)
+			if (!strcmp(type, type_names[e[i].type]))
+				break;
+		if (e[i].type > BUNDLE_BLOB) {
+			printf("Unknown artifact type %s\n", type);
+			exit(1);
+		}
+
+		e[i].data = map_file(file, &e[i].size, &fd);
+		close(fd);
+		e[i].offset = offset;
+		offset += e[i].size;
+		sha256(e[i].data, e[i].size, e[i].sha);
+
+		if ((e[i].type == BUNDLE_BRIDGE) && !(ver && ver[0]) &&
+			!(ver = stm32f_image_version(file, version,
+			sizeof(version)))) {
+			printf("Unknown version of %s, use bridge:%s:<version> or %s.version\n",
+				file, file, file);
+			exit(1);
+		}
+		if (ver && (strlen(ver) >= sizeof(e[i].version))) {
+			printf("Version %s is too long\n", ver);
+			exit(1);
+		}
+		if (ver)
+			strcpy(e[i].version, ver);
+
+		if (e[i].type == BUNDLE_BRIDGE) {
+			/* not in STM32W flash */
+		} else if ((e[i].type == BUNDLE_APP) && !(addr && addr[0])) {
+			e[i].addr = FLASH_BASE;
+		} else if (!addr || !addr[0] ||
+			((e[i].addr = strtoul(addr, &end, 0)), *end)) {
+			printf("Wrong address for %s\n", file);
+			exit(1);
+		}
+		snprintf(e[i].name, sizeof(e[i].name), "%s", basename(file));
+		print_entry(&e[i]);
+		printf("\n");
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, BUNDLE_MAGIC, 8);
+	put_u32(hdr + 8, argc);
+	for (i = 0; i < argc; i++) {
+		uint8_t *p = hdr + BUNDLE_HDR_SIZE + i * BUNDLE_ENTRY_SIZE;
+
+		put_u32(p, e[i].type);
+		put_u32(p + 4, e[i].addr);
+		put_u32(p + 8, e[i].offset);
+		put_u32(p + 12, e[i].size);
+		memcpy(p + 16, e[i].sha, 32);
+		memcpy(p + 48, e[i].version, 16);
+		memcpy(p + 64, e[i].name, 32);
+	}
+
+	out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((out < 0) || (write(out, hdr, BUNDLE_HDR_SIZE +
+		argc * BUNDLE_ENTRY_SIZE) != BUNDLE_HDR_SIZE + argc *
+		BUNDLE_ENTRY_SIZE)) {
+		printf("Cannot write file %s\n", filename);
+		exit(1);
+	}
+	for (i = 0; i < argc; i++) {
+		if (write(out, e[i].data, e[i].size) != e[i].size) {
+			printf("Cannot write file %s\n", filename);
+			exit(1);
+		}
+		munmap(e[i].data, e[i].size);
+	}
+	close(out);
+	printf("Bundle %s written, %u bytes.\n", filename, offset);
+	return 0;
+}
+
+/*
+ * Parse and check the whole bundle before the device is touched: entry
+ * bounds, hashes and that no two flash images overlap.
+ */
+static int bundle_load(uint8_t *b, uint32_t size, struct bundle_entry *e)
+{
+	uint8_t sha[32], *p;
+	int i, j, n;
+
+	if ((size < BUNDLE_HDR_SIZE) || memcmp(b, BUNDLE_MAGIC, 8)) {
+		printf("Not a flash32w bundle\n");
+		exit(1);
+	}
+	n = get_u32(b + 8);
+	if ((n == 0) || (n > BUNDLE_MAX_ENTRIES) ||
+		(BUNDLE_HDR_SIZE + n * BUNDLE_ENTRY_SIZE > size)) {
+		printf("Wrong number of bundle entries\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		p = b + BUNDLE_HDR_SIZE + i * BUNDLE_ENTRY_SIZE;
+		e[i].type = get_u32(p);
+		e[i].addr = get_u32(p + 4);
+		e[i].offset = get_u32(p + 8);
+		e[i].size = get_u32(p + 12);
+		memcpy(e[i].sha, p + 16, 32);
+		memcpy(e[i].version, p + 48, 16);
+		e[i].version[15] = 0;
+		memcpy(e[i].name, p + 64, 32);
+		e[i].name[31] = 0;
+
+		if ((e[i].type < BUNDLE_BRIDGE) || (e[i].type > BUNDLE_BLOB)) {
+			printf("Entry %i: unknown type %u\n", i, e[i].type);
+			exit(1);
+		}
+		if ((e[i].size == 0) || (e[i].offset > size) ||
+			(e[i].size > size - e[i].offset)) {
+			printf("Entry %i: data outside of bundle\n", i);
+			exit(1);
+		}
+		e[i].data = b + e[i].offset;
+		sha256(e[i].data, e[i].size, sha);
+		if (memcmp(sha, e[i].sha, 32)) {
+			printf("Entry %i: SHA-256 mismatch\n", i);
+			exit(1);
+		}
+		if ((e[i].type == BUNDLE_BRIDGE) && !e[i].version[0]) {
+			printf("Entry %i: bridge firmware without version\n", i);
+			exit(1);
+		}
+		if ((e[i].type != BUNDLE_BRIDGE) &&
+			!plan_fits(e[i].addr, e[i].size)) {
+			printf("Entry %i: 0x%08x (%u bytes) is outside of flash\n",
+				i, e[i].addr, e[i].size);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < i; j++) {
+			if ((e[i].type == BUNDLE_BRIDGE) ||
+				(e[j].type == BUNDLE_BRIDGE)) {
+				if (e[i].type == e[j].type) {
+					printf("More than one bridge firmware\n");
+					exit(1);
+				}
+				continue;
+			}
+			if ((e[i].addr < e[j].addr + e[j].size) &&
+				(e[j].addr < e[i].addr + e[i].size)) {
+				printf("Entries %i and %i overlap\n", j, i);
+				exit(1);
+			}
+		}
+	return n;
+}
+
+/* entry holding the whole write block at addr, or NULL */
+static struct bundle_entry *block_entry(struct bundle_entry *e, int n,
+	uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if ((e[i].type != BUNDLE_BRIDGE) && (addr >= e[i].addr) &&
+			(addr - e[i].addr + WRITE_BLOCK_SIZE <= e[i].size))
+			return &e[i];
+	return NULL;
+}
+
+/* copy the bytes of all flash entries within [addr, addr + len) to buff */
+static void bundle_overlay(struct bundle_entry *e, int n, uint32_t addr,
+	uint8_t *buff, uint32_t len)
+{
+	uint32_t lo, hi;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (e[i].type == BUNDLE_BRIDGE)
+			continue;
+		/* bundle_load() made sure addr + size does not wrap */
+		lo = (e[i].addr > addr) ? e[i].addr : addr;
+		hi = e[i].addr + e[i].size;
+		if (hi > addr + len)
+			hi = addr + len;
+		if (lo < hi)
+			memcpy(buff + (lo - addr), e[i].data + (lo - e[i].addr),
+				hi - lo);
+	}
+}
+
+/*
+ * Pages a blob shares with other data (e.g. calibration) are read back
+ * before the erase and the entries merged into them, so that data
+ * survives the deploy. Other partial blocks, like the end of an app,
+ * are padded with 0xFF as -f does.
+ */
+static void bundle_merge(struct bundle_entry *e, int n, struct flash_plan *p,
+	uint8_t *partial)
+{
+	uint32_t pg, a;
+	int i, j, nread = 0;
+
+	for (i = 0; i < p->npages; i++) {
+		pg = p->pages[i];
+		a = FLASH_BASE + pg * FLASH_PAGE_SIZE;
+		for (j = 0; j < n; j++)
+			if ((e[j].type == BUNDLE_BLOB) &&
+				(e[j].addr < a + FLASH_PAGE_SIZE) &&
+				(a < e[j].addr + e[j].size))
+				break;
+		if (j == n)
+			continue;
+		for (j = 0; j < FLASH_PAGE_SIZE; j += WRITE_BLOCK_SIZE)
+			if (!block_entry(e, n, a + j))
+				partial[pg] = 1;
+		nread += partial[pg];
+	}
+	if (nread == 0)
+		return;
+
+	metrics_phase_begin(PHASE_READ);
+	printf("Reading %u flash pages shared with blobs ...", nread);
+	fflush(stdout);
+	for (i = 0; i < p->npages; i++) {
+		pg = p->pages[i];
+		if (!partial[pg])
+			continue;
+		a = FLASH_BASE + pg * FLASH_PAGE_SIZE;
+		if (stm32w_read(a, merged[pg], FLASH_PAGE_SIZE)) {
+			printf("\nFailed to read page %u\n", pg);
+			exit(1);
+		}
+		metrics_add_bytes(FLASH_PAGE_SIZE);
+		bundle_overlay(e, n, a, merged[pg], FLASH_PAGE_SIZE);
+	}
+	printf(", done.\n");
+}
+
+int bundle_deploy(char *filename)
+{
+	struct bundle_entry e[BUNDLE_MAX_ENTRIES], *be;
+	struct flash_plan p;
+	uint8_t partial[FLASH_PAGES];
+	uint8_t buff[WRITE_BLOCK_SIZE];
+	uint8_t *b, *data;
+	uint32_t size, a, pg;
+	int i, j, n, fd, bridge = -1;
+
+	b = map_file(filename, &size, &fd);
+	n = bundle_load(b, size, e);
+
+	plan_init(&p);
+	for (i = 0; i < n; i++) {
+		print_entry(&e[i]);
+		printf(" ok\n");
+		if (e[i].type == BUNDLE_BRIDGE)
+			bridge = i;
+		else if (plan_add_image(&p, e[i].addr, e[i].size)) {
+			printf("Bundle does not fit into flash\n");
+			exit(1);
+		}
+	}
+
+	if ((bridge >= 0) && stm32f_app_version_is(e[bridge].version)) {
+		printf("STM32F firmware is up to date, skipping.\n");
+	} else if (bridge >= 0) {
+		stm32f_write_bl_data(e[bridge].name, e[bridge].data,
+			e[bridge].size);
+		/* back to the bridge application for the STM32W steps */
+		stm32f_run_app();
+	}
+
+	if (p.npages == 0) {
+		metrics_phase_end();
+		munmap(b, size);
+		close(fd);
+		return 0;
+	}
+
+	stm32w_enter_bl();
+
+	memset(partial, 0, sizeof(partial));
+	bundle_merge(e, n, &p, partial);
+
+	metrics_phase_begin(PHASE_ERASE);
+	printf("Erasing flash pages ");
+	plan_print_pages(&p);
+	printf(" ...");
+	if (plan_erase(&p)) {
+		printf("Failed to erase flash.\n");
+		exit(1);
+	}
+	printf(", done.\n");
+
+	/* whole blocks go straight from the mapping */
+	metrics_phase_begin(PHASE_WRITE);
+	for (i = 0; i < p.npages; i++) {
+		pg = p.pages[i];
+		for (j = 0; j < FLASH_PAGE_SIZE; j += WRITE_BLOCK_SIZE) {
+			a = FLASH_BASE + pg * FLASH_PAGE_SIZE + j;
+			if (partial[pg]) {
+				data = merged[pg] + j;
+			} else if ((be = block_entry(e, n, a))) {
+				data = be->data + (a - be->addr);
+			} else {
+				memset(buff, 0xFF, sizeof(buff));
+				bundle_overlay(e, n, a, buff, sizeof(buff));
+				data = buff;
+			}
+			if (plan_block_empty(data))
+				continue;
+			if (stm32w_bl_write_mem(a, data, WRITE_BLOCK_SIZE)) {
+				printf("\nFailed to write block to address 0x%08x\n",
+					a);
+				exit(1);
+			}
+			metrics_add_bytes(WRITE_BLOCK_SIZE);
+			printf("\rWriting 0x%08x (%u %%)...", a,
+				(i + 1) * 100 / p.npages);
+			fflush(stdout);
+		}
+	}
+	printf(", done.\n");
+	metrics_phase_end();
+
+	munmap(b, size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+
+#include "flash32w.h"
+
+/*
+ * On-disk snapshot of the fixed information block (bootloader, burned-in
+ * EUI-64) and the customer information block, keyed by the EUI-64.
+ * Both are read-only in practice; the CIB option bytes are re-read on
+ * every open to detect a board whose CIB was changed by another tool.
+ */
+
+#define CACHE_BASE	0x08040000
+#define CACHE_SIZE	0x1000
+#define CACHE_MAGIC	"F32WCAC1"
+#define EUI64_ADDR	0x080407A2
+#define PROBE_ADDR	0x08040800
+#define PROBE_LEN	16
+
+static struct {
+	char magic[8];
+	uint8_t valid[CACHE_SIZE / 8];
+	uint8_t data[CACHE_SIZE];
+} cache;
+
+static int enabled, dirty;
+static char path[1100];
+
+static int is_valid(uint32_t off, uint32_t len)
+{
+	for (; len; off++, len--)
+		if (!(cache.valid[off / 8] & (1 << (off % 8))))
+			return 0;
+	return 1;
+}
+
+static void store(uint32_t addr, uint8_t *data, uint32_t len)
+{
+	uint32_t off;
+
+	for (; len; addr++, data++, len--) {
+		if ((addr < CACHE_BASE) || (addr >= CACHE_BASE + CACHE_SIZE))
+			continue;
+		off = addr - CACHE_BASE;
+		cache.data[off] = *data;
+		cache.valid[off / 8] |= 1 << (off % 8);
+		dirty = 1;
+	}
+}
+
+static int cache_path(uint8_t *eui)
+{
+	char *base, dir[1024];
+
+	if ((base = getenv("XDG_CACHE_HOME")))
+		snprintf(dir, sizeof(dir), "%s", base);
+	else if ((base = getenv("HOME")))
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+	else
+		return -1;
+
+	mkdir(dir, 0755);
+	strncat(dir, "/flash32w", sizeof(dir) - strlen(dir) - 1);
+
+	if (mkdir(dir, 0755) && (errno != EEXIST))
+		return -1;
+
+	snprintf(path, sizeof(path),
+		"%s/%02x%02x%02x%02x%02x%02x%02x%02x.bin", dir, eui[7], eui[6],
+		eui[5], eui[4], eui[3], eui[2], eui[1], eui[0]);
+	return 0;
+}
+
+int cache_overlaps(uint32_t addr, uint32_t len)
+{
+	return (addr < CACHE_BASE + CACHE_SIZE) && (addr + len > CACHE_BASE);
+}
+
+/* Device must be in bootloader mode */
+int cache_open(int enable)
+{
+	uint8_t eui[8], probe[PROBE_LEN];
+	int fd;
+
+	if (!enable)
+		return 0;
+
+	if (stm32w_bl_read_mem(EUI64_ADDR, eui, 8) ||
+		stm32w_bl_read_mem(PROBE_ADDR, probe, PROBE_LEN) ||
+		cache_path(eui))
+		return -1;
+
+	memset(&cache, 0, sizeof(cache));
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if ((read(fd, &cache, sizeof(cache)) != sizeof(cache)) ||
+			memcmp(cache.magic, CACHE_MAGIC, 8))
+			memset(&cache, 0, sizeof(cache));
+		close(fd);
+	}
+
+	if (is_valid(PROBE_ADDR - CACHE_BASE, PROBE_LEN) &&
+		memcmp(cache.data + PROBE_ADDR - CACHE_BASE, probe, PROBE_LEN)) {
+		printf("Cached device information is stale, discarding.\n");
+		memset(&cache, 0, sizeof(cache));
+	}
+
+	memcpy(cache.magic, CACHE_MAGIC, 8);
+	store(EUI64_ADDR, eui, 8);
+	store(PROBE_ADDR, probe, PROBE_LEN);
+	enabled = 1;
+	return 0;
+}
+
+int cache_read(uint32_t addr, uint8_t *data, uint32_t len)
+{
+	if (enabled && (addr >= CACHE_BASE) &&
+		(addr + len <= CACHE_BASE + CACHE_SIZE) &&
+		is_valid(addr - CACHE_BASE, len)) {
+		memcpy(data, cache.data + addr - CACHE_BASE, len);
+		return 0;
+	}
+
+	if (stm32w_read(addr, data, len))
+		return -1;
+	if (enabled)
+		store(addr, data, len);
+	return 0;
+}
+
+int cache_close()
+{
+	char tmp[1200];
+	int fd;
+
+	if (!enabled || !dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (write(fd, &cache, sizeof(cache)) != sizeof(cache)) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	return rename(tmp, path);
+}
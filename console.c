@@ -0,0 +1,173 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+
+
+#include "flash32w.h"
+
+#define SLOT_SIZE		512
+#define RING_SLOTS		1024	/* power of 2 */
+
+struct slot {
+	struct timespec ts;
+	int len;
+	uint8_t data[SLOT_SIZE];
+};
+
+/* single producer (transport receive thread), single consumer (output) ring */
+static struct slot ring[RING_SLOTS];
+static uint32_t ring_head, ring_tail;
+static uint32_t dropped;
+
+static volatile sig_atomic_t stop;
+
+static void console_rx(uint8_t *data, int len)
+{
+	uint32_t head, tail;
+	struct slot *s;
+	int n;
+
+	if (len < 0) {
+		stop = 1;
+		return;
+	}
+
+	for (; len > 0; data += n, len -= n) {
+		n = (len > SLOT_SIZE) ? SLOT_SIZE : len;
+		head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+		if (head - tail == RING_SLOTS) {
+			__atomic_add_fetch(&dropped, n, __ATOMIC_RELAXED);
+			continue;
+		}
+		s = &ring[head & (RING_SLOTS - 1)];
+		clock_gettime(CLOCK_REALTIME, &s->ts);
+		s->len = n;
+		memcpy(s->data, data, n);
+		__atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void sigint(int sig)
+{
+	stop = 1;
+}
+
+static int out_flush(int fd, char *out, char *o)
+{
+	if (write(fd, out, o - out) != o - out) {
+		fprintf(stderr, "Console output failed\n");
+		stop = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static char *put_ts(char *o, struct timespec *ts)
+{
+	struct tm tm;
+
+	localtime_r(&ts->tv_sec, &tm);
+	return o + sprintf(o, "[%02u:%02u:%02u.%06u] ", tm.tm_hour, tm.tm_min,
+		tm.tm_sec, (unsigned) (ts->tv_nsec / 1000));
+}
+
+int console_run(uint32_t baud, char *filename)
+{
+	static char out[65536];
+	struct slot *s;
+	uint32_t head, tail;
+	int fd = STDOUT_FILENO;
+	int i, bol = 1;
+	char *o;
+
+	if (filename) {
+		fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd < 0) {
+			printf("Cannot open file %s\n", filename);
+			exit(1);
+		}
+	}
+
+	fflush(stdout);
+	serial_set_baudrate(baud);
+	signal(SIGINT, sigint);
+	signal(SIGTERM, sigint);
+
+	if (serial_rx_start(console_rx)) {
+		printf("Failed to start console\n");
+		exit(1);
+	}
+
+	fprintf(stderr, "Console at %u baud, Ctrl-C to quit.\n", baud);
+	while (1) {
+		head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+		tail = ring_tail;
+
+		if (head == tail) {
+			if (stop)
+				break;
+			usleep(1000);
+			continue;
+		}
+
+		/* drain everything available, writing in large chunks */
+		o = out;
+		for (; tail != head; tail++) {
+			s = &ring[tail & (RING_SLOTS - 1)];
+			for (i = 0; i < s->len; i++) {
+				if (o > out + sizeof(out) - 32) {
+					out_flush(fd, out, o);
+					o = out;
+				}
+				if (bol)
+					o = put_ts(o, &s->ts);
+				*o++ = s->data[i];
+				bol = (s->data[i] == '\n');
+			}
+			__atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+		}
+		out_flush(fd, out, o);
+	}
+
+	serial_rx_stop();
+
+	if (dropped)
+		fprintf(stderr, "Console dropped %u bytes\n", dropped);
+	if (filename)
+		close(fd);
+	return 0;
+}
@@ -4,6 +4,17 @@
 
 #define MAX_XFER_SIZE	256
 
+#define FLASH_BASE		0x08000000
+#define FLASH_PAGE_SIZE		1024
+/* pages below the bootloader's erase limit, the rest is not writable */
+#define FLASH_PAGES		116
+#define FLASH_SIZE		(FLASH_PAGES * FLASH_PAGE_SIZE)
+#define WRITE_BLOCK_SIZE	256
+#define MAX_WRITE_BLOCKS	(FLASH_PAGES * FLASH_PAGE_SIZE / WRITE_BLOCK_SIZE)
+
+/* "xxxxxxxx: " + 16 x "xx " + 2 separators + 16 chars + newline */
+#define HEXDUMP_LINE_MAX	(10 + 48 + 2 + 16 + 1)
+
 #define CMD_SET_nRESET			0
 #define CMD_SET_nBOOTMODE		1
 #define CMD_GET_CODE_TYPE		2
@@ -18,29 +29,156 @@
 #define CMD_IS_BL_VERSION_OLD		11
 #define CMD_ENABLE_SERIAL_PARSING	12
 
-#define serial_set_baudrate(x)		stm32f_usb_set_baudrate(x)
-#define serial_open(x)			stm32f_usb_open(x)
-#define serial_close(x)			stm32f_usb_close(x)
-#define serial_send(x,y,z)		stm32f_usb_send(x,y,z)
-#define serial_recv(x,y,z)		stm32f_usb_recv(x,y,z)
+enum {
+	PHASE_NONE,
+	PHASE_RESET,
+	PHASE_ERASE,
+	PHASE_WRITE,
+	PHASE_VERIFY,
+	PHASE_YMODEM,
+	PHASE_READ,
+	PHASE_MAX
+};
+
+struct flash_plan {
+	uint8_t erase[FLASH_PAGES];
+	uint8_t pages[FLASH_PAGES];
+	int npages;
+	uint32_t blocks[MAX_WRITE_BLOCKS];
+	int nblocks;
+};
+
+struct write_frame {
+	uint32_t addr;
+	int len;
+	uint8_t addr_frame[5];
+	uint8_t data_frame[WRITE_BLOCK_SIZE + 2];
+};
+
+struct link_model {
+	double latency;		/* seconds per USB transfer */
+	double bandwidth;	/* UART bytes per second */
+	double page_erase;	/* seconds per erased page */
+	double reset;		/* reset and sync, including sleeps */
+};
+
+struct plan_cost {
+	uint32_t payload;
+	uint32_t wire_bytes;
+	uint32_t xfers;
+	double reset, erase, write;
+};
+
+/* receive callback of a stream, len < 0 once the stream has ended */
+typedef void (*serial_rx_cb)(uint8_t *data, int len);
+
+struct serial_ops {
+	int (*open)();
+	int (*close)();
+	int (*send)(uint8_t *data, int length, int *transfered);
+	int (*recv)(uint8_t *data, int length, int *transfered);
+	int (*set_baudrate)(uint32_t b);
+	int (*sleep)(uint32_t usec);
+	int (*rx_start)(serial_rx_cb cb);
+	int (*rx_stop)();
+};
+
+extern struct serial_ops *serial;
+extern struct serial_ops stm32f_usb_ops;
+
+#define serial_set_baudrate(x)		serial->set_baudrate(x)
+#define serial_open(x)			serial->open(x)
+#define serial_close(x)			serial->close(x)
+#define serial_send(x,y,z)		serial->send(x,y,z)
+#define serial_recv(x,y,z)		serial->recv(x,y,z)
+#define serial_sleep(x)			serial->sleep(x)
+#define serial_rx_start(x)		serial->rx_start(x)
+#define serial_rx_stop(x)		serial->rx_stop(x)
 
 int stm32f_usb_open();
 int stm32f_usb_close();
 int stm32f_usb_send(uint8_t *data, int length, int *transfered);
 int stm32f_usb_recv(uint8_t *data, int length, int *transfered);
 int stm32f_usb_set_baudrate(uint32_t b);
+int stm32f_usb_sleep(uint32_t usec);
+int stm32f_usb_rx_start(serial_rx_cb cb);
+int stm32f_usb_rx_stop();
+void stm32f_usb_select(char *port, char *sn);
+int stm32f_usb_list();
 int stm32f_write_bl(char *filename);
+int stm32f_write_bl_data(char *name, uint8_t *data, uint32_t size);
+int stm32f_read_bl(char *filename);
+int stm32f_run_app();
+char *stm32f_image_version(char *filename, char *buff, int len);
+int stm32f_app_version_is(char *version);
 int stm32f_cmd_1_1(uint8_t c, uint8_t *v);
 int stm32f_cmd_1_4(uint8_t c, uint32_t *v);
 int stm32f_cmd_2_1(uint8_t c1, uint8_t c2,  uint8_t *v);
 
 int stm32w_reset();
+int stm32w_run();
+int stm32w_enter_bl();
 int stm32w_bl_ping();
 int stm32w_bl_get(uint8_t *blver);
 int stm32w_bl_getid(uint16_t *id);
 int stm32w_bl_write_mem(uint32_t addr, uint8_t *data, int len);
+int stm32w_bl_write_prepare(struct write_frame *f, uint32_t addr,
+	uint8_t *data, int len);
+int stm32w_bl_write_frame(struct write_frame *f);
 int stm32w_bl_read_mem(uint32_t addr, uint8_t *data, uint8_t len);
+int stm32w_read(uint32_t addr, uint8_t *data, uint32_t len);
 int stm32w_bl_erase(uint8_t start, uint8_t num);
+int stm32w_bl_erase_pages(uint8_t *pages, int num);
+
+void plan_init(struct flash_plan *p);
+int plan_fits(uint32_t addr, uint32_t size);
+int plan_add_image(struct flash_plan *p, uint32_t addr, uint32_t size);
+void plan_add_page(struct flash_plan *p, uint32_t pg);
+int plan_block_empty(uint8_t *data);
+int plan_erase(struct flash_plan *p);
+void plan_print_pages(struct flash_plan *p);
+void plan_estimate(struct flash_plan *p, struct link_model *m,
+	struct plan_cost *c);
+void model_init(struct link_model *m);
+int model_load(struct link_model *m, char *filename);
+
+int pipeline_start(int fd, struct flash_plan *p);
+struct write_frame *pipeline_get();
+void pipeline_release();
+void pipeline_finish();
+
+int patch_file(uint32_t addr, char *filename);
+int patch_csv(char *filename);
+
+int watch_app(uint32_t addr, char *filename);
+
+int console_run(uint32_t baud, char *filename);
+
+int cache_overlaps(uint32_t addr, uint32_t len);
+int cache_open(int enable);
+int cache_read(uint32_t addr, uint8_t *data, uint32_t len);
+int cache_close();
+
+int bundle_create(char *filename, int argc, char **argv);
+int bundle_deploy(char *filename);
+
+void sha256(const uint8_t *data, uint32_t len, uint8_t *digest);
+
+int record_start(char *filename);
+int replay_start(char *filename, int realtime);
+
+int hexdump_format(char *out, uint32_t addr, uint8_t *data, int len);
+int hexdump_write(int fd, uint32_t addr, uint8_t *data, int len);
+
+int metrics_init(int fd, char *prom);
+void metrics_phase_begin(int phase);
+void metrics_phase_end();
+void metrics_add_bytes(uint32_t n);
+void metrics_add_erased(uint32_t pages);
+void metrics_retry();
+void metrics_nack();
+void metrics_usb_xfer(uint32_t len);
+void metrics_finish(int status);
 
 #endif /* _FLASH32W_H_ */
 
@@ -0,0 +1,119 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "flash32w.h"
+
+static char hex_pairs[512];
+
+static void hexdump_init()
+{
+	const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		hex_pairs[i * 2] = digits[i >> 4];
+		hex_pairs[i * 2 + 1] = digits[i & 0xf];
+	}
+}
+
+static char *put_hex32(char *o, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		memcpy(o, hex_pairs + ((v >> 24) & 0xff) * 2, 2);
+		v <<= 8;
+		o += 2;
+	}
+	return o;
+}
+
+/*
+ * Format len bytes as "addr: xx xx ... xx  xx ... xx  ascii" lines into out,
+ * which must hold HEXDUMP_LINE_MAX bytes for each started 16 byte line.
+ */
+int hexdump_format(char *out, uint32_t addr, uint8_t *data, int len)
+{
+	char *o = out;
+	int i, n;
+
+	if (!hex_pairs[0])
+		hexdump_init();
+
+	while (len > 0) {
+		n = (len > 16) ? 16 : len;
+		o = put_hex32(o, addr);
+		*o++ = ':';
+		*o++ = ' ';
+
+		for (i = 0; i < 16; i++) {
+			if (i < n) {
+				memcpy(o, hex_pairs + data[i] * 2, 2);
+			} else {
+				o[0] = ' ';
+				o[1] = ' ';
+			}
+			o[2] = ' ';
+			o += 3;
+			if ((i == 7) || (i == 15))
+				*o++ = ' ';
+		}
+
+		for (i = 0; i < n; i++)
+			*o++ = ((data[i] < 0x20) || (data[i] > 0x7e)) ? '.' : data[i];
+		*o++ = '\n';
+
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	return o - out;
+}
+
+int hexdump_write(int fd, uint32_t addr, uint8_t *data, int len)
+{
+	char buff[HEXDUMP_LINE_MAX * 16];
+	int n, w, r, off;
+
+	/* one write() per 256 bytes of input */
+	for (off = 0; off < len; off += 256) {
+		n = hexdump_format(buff, addr + off, data + off,
+			(len - off > 256) ? 256 : len - off);
+		for (w = 0; w < n; w += r) {
+			r = write(fd, buff + w, n - w);
+			if (r <= 0)
+				return -1;
+		}
+	}
+	return 0;
+}
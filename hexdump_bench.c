@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Compares the table driven hexdump_format() with the per byte printf()
+ * formatting dump_mem() used before, both writing to /dev/null.
+ *
+ *   hexdump_bench [bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "flash32w.h"
+
+/* read chunk of stm32w_bl_read_mem() */
+#define CHUNK	96
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the formatting loop of dump_mem() before hexdump_format() */
+static void dump_printf(FILE *f, uint32_t addr, uint8_t *mem, uint32_t length)
+{
+	uint32_t left = length;
+	uint8_t *data;
+	uint8_t chars[17];
+	int i = 0;
+
+	chars[16]=0;
+	fprintf(f, "%08x: ", addr);
+	while (left>0) {
+		data = mem + length - left;
+		for(i=0;i<((left>CHUNK) ? CHUNK : left);i++) {
+			fprintf(f, "%02x ", data[i]);
+			chars[i%16]  = ((data[i]<0x20) || (data[i]>0x7e)) ? '.':data[i];
+			if(!((i+1)%8))
+				fprintf(f, " ");
+			if(!((i+1)%16)) {
+				fprintf(f, "%s", chars);
+				if(left-i-1)
+					fprintf(f, "\n%08x: ", addr + length - left + i + 1);
+			}
+		}
+		left -= ((left>CHUNK) ? CHUNK : left);
+	}
+	chars[i%16] = 0;
+	while (((i++))%16) {
+		fprintf(f, "   ");
+		if((i%16)==8)
+			fprintf(f, " ");
+	}
+	fprintf(f, " %s\n", chars);
+	fflush(f);
+}
+
+static void dump_table(int fd, uint32_t addr, uint8_t *mem, uint32_t length)
+{
+	uint32_t off, n;
+
+	for (off = 0; off < length; off += n) {
+		n = (length - off > CHUNK) ? CHUNK : length - off;
+		if (hexdump_write(fd, addr + off, mem + off, n)) {
+			printf("Write failed\n");
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t len = 1024 * 1024;
+	uint32_t i;
+	uint8_t *mem;
+	double t0, t1, t2;
+	FILE *f;
+
+	if ((argc > 1) && (sscanf(argv[1], "%i", (int *) &len) != 1)) {
+		printf("Usage: %s [bytes]\n", argv[0]);
+		exit(1);
+	}
+	if (!(mem = malloc(len)) || !(f = fopen("/dev/null", "w"))) {
+		printf("Setup failed\n");
+		exit(1);
+	}
+	for (i = 0; i < len; i++)
+		mem[i] = i * 7 + 3;
+
+	t0 = now();
+	dump_printf(f, FLASH_BASE, mem, len);
+	t1 = now();
+	dump_table(fileno(f), FLASH_BASE, mem, len);
+	t2 = now();
+
+	printf("%u bytes in %u byte chunks:\n", len, CHUNK);
+	printf(" %-16s %8.2f ms\n", "printf", (t1 - t0) * 1000);
+	printf(" %-16s %8.2f ms\n", "hexdump_format", (t2 - t1) * 1000);
+	printf(" %-16s %8.2fx\n", "speedup", (t1 - t0) / (t2 - t1));
+	fclose(f);
+	free(mem);
+	return 0;
+}
@@ -36,7 +36,7 @@
 
 #include "flash32w.h"
 	
-int stm32w_info()
+int stm32w_info(int use_cache)
 {
 	int i;
 	uint8_t buff[MAX_XFER_SIZE];
@@ -61,27 +61,31 @@ int stm32w_info()
 	printf(" %-32s %u.%u.%u.%u\n","Firmware Version:",
 		(x>>24) & 0xff, (x>>16) & 0xff, (x>>8) & 0xff, x & 0xff);
 
+	metrics_phase_begin(PHASE_RESET);
 	stm32w_reset();
 
 	serial_set_baudrate(115200);
 	
 	printf("\nSTM32W108 Device information:\n");
 	stm32w_bl_ping();
+	metrics_phase_begin(PHASE_READ);
 	stm32w_bl_get(&y);
 	printf(" %-32s %u\n","BootLoader Version:",y);
 
 	stm32w_bl_getid(&z);
 	printf(" %-32s 0x%04x\n","Device Type:",z);
 
+	cache_open(use_cache);
+
 #define PRINT_EUI64_ADDR(a, s) \
-	stm32w_bl_read_mem(a, buff, 8);		\
+	cache_read(a, buff, 8);		\
 	printf(" %-32s ", s);				\
 	for(i=7;i>0;i--)				\
 		printf("%02x:", buff[i]);		\
 	printf("%02x\n", buff[0]);
 
 #define PRINT_STRING(a, l, s) \
-	stm32w_bl_read_mem(a, buff, l);		\
+	cache_read(a, buff, l);		\
 	printf(" %-32s ", s);				\
 	for(i=0;i<l;i++)				\
 		printf("%c", ((buff[i]<0x20) || (buff[i]>0x7f)) ? '.' : buff[i]); \
@@ -93,7 +97,7 @@ int stm32w_info()
 	PRINT_STRING(0x0804082A, 16, "CIB Manufacturer Board Name:");
 
 	/* Read Option Bytes from CIB */
-	stm32w_bl_read_mem(0x08040800, buff, 16);
+	cache_read(0x08040800, buff, 16);
 	printf(" %-32s 0x%02x (%s)\n","CIB Read Protection:", buff[0],
 		(buff[0] == 0xa5) ? "inactive" : "active" );
 	x = buff[8] | buff[10]<<8 | buff[12]<<16 | buff[14]<<24;
@@ -109,18 +113,21 @@ int stm32w_info()
 	printf("\n");
 
 	/* Read PHY Config from CIB */
-	stm32w_bl_read_mem(0x0804083C, buff, 2);
+	cache_read(0x0804083C, buff, 2);
 	printf(" %-32s %02x %02x\n","CIB PHY Config:", buff[0], buff[1]);
+	cache_close();
 
 	printf("\n");
+	metrics_phase_end();
 	return 0;
 }
 
 int flash_app(uint32_t addr, char *filename)
 {
+	struct flash_plan p;
+	struct write_frame *f;
 	struct stat s;
 	int fd, i;
-	uint8_t buff[MAX_XFER_SIZE];
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
@@ -129,76 +136,118 @@ int flash_app(uint32_t addr, char *filename)
 	}
 	fstat(fd, &s);
 
-	serial_set_baudrate(50);
-	stm32w_reset();
-	serial_set_baudrate(115200);
-	stm32w_bl_ping();
+	plan_init(&p);
+	if (plan_add_image(&p, addr, s.st_size)) {
+		printf("Image does not fit into flash at 0x%08x\n", addr);
+		exit(1);
+	}
+
+	/* frames are built while the device resets */
+	pipeline_start(fd, &p);
 
-	printf("Erasing flash pages %i to %i ...", 0, (int) s.st_size/1024+1);
-	if(stm32w_bl_erase(0,(int) s.st_size/1024+1)) {
+	stm32w_enter_bl();
+
+	metrics_phase_begin(PHASE_ERASE);
+	printf("Erasing flash pages ");
+	plan_print_pages(&p);
+	printf(" ...");
+	if(plan_erase(&p)) {
 		printf("Failed to erase flash.");
 		exit(1);
 	}
 	printf(", done.\n");
+
+	metrics_phase_begin(PHASE_WRITE);
 	printf("Writing %i bytes from %s to flash:\n",(int) s.st_size, filename);
-	for(i=0;i<s.st_size; i+=256) {
-		memset(buff, 0xFF, 256);
-		if (read(fd, buff, 256) <= 0)
-			break;
-		if(stm32w_bl_write_mem(addr+i, buff, 256)) {
-			printf("Failed to write block to address 0x%08x\n", addr + i);
+	for(i=0;(f = pipeline_get());i++) {
+		if(stm32w_bl_write_frame(f)) {
+			printf("Failed to write block to address 0x%08x\n",
+				f->addr);
 			exit(1);
 		}
-		printf("\rWriting 0x%08x (%u %%)...", addr + i,
-			i * 100 / (int) s.st_size + 1);
+		metrics_add_bytes(f->len);
+		printf("\rWriting 0x%08x (%u %%)...", f->addr,
+			(i + 1) * 100 / p.nblocks);
 		fflush(stdout);
+		pipeline_release();
 	}	
 	printf(", done.\n");
+	metrics_phase_end();
+	pipeline_finish();
+	close(fd);
 	return 0;
 }
 
-int dump_mem(uint32_t addr, uint32_t length)
+int flash_app_dry_run(uint32_t addr, char *filename, char *model_file)
+{
+	struct flash_plan p;
+	struct link_model m;
+	struct plan_cost c;
+	struct stat s;
+
+	if (stat(filename, &s)) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+
+	plan_init(&p);
+	if (plan_add_image(&p, addr, s.st_size)) {
+		printf("Image does not fit into flash at 0x%08x\n", addr);
+		exit(1);
+	}
+
+	model_init(&m);
+	if (model_file && model_load(&m, model_file)) {
+		printf("Cannot read model from %s\n", model_file);
+		exit(1);
+	}
+	plan_estimate(&p, &m, &c);
+
+	printf("Dry run of writing %i bytes from %s to 0x%08x:\n",
+		(int) s.st_size, filename, addr);
+	printf(" %-32s ", "Erase pages:");
+	plan_print_pages(&p);
+	printf(" (%u)\n", p.npages);
+	printf(" %-32s %u x %u bytes\n", "Write transactions:", p.nblocks,
+		WRITE_BLOCK_SIZE);
+	printf(" %-32s %u\n", "USB transfers:", c.xfers);
+	printf(" %-32s %u (%u payload, %u framing)\n", "Bytes on wire:",
+		c.wire_bytes, c.payload, c.wire_bytes - c.payload);
+	printf(" %-32s %.3f ms/xfer, %.0f B/s, %.1f ms/page\n", "Model:",
+		m.latency * 1e3, m.bandwidth, m.page_erase * 1e3);
+	printf(" %-32s %.2f s (reset %.2f, erase %.2f, write %.2f)\n",
+		"Estimated time:", c.reset + c.erase + c.write, c.reset,
+		c.erase, c.write);
+	return 0;
+}
+
+int dump_mem(uint32_t addr, uint32_t length, int use_cache)
 {
 	uint32_t left = length;
+	uint32_t n;
 	uint8_t data[96];
-	uint8_t chars[17];
-	int i;
 
-	serial_set_baudrate(50);
-	stm32w_reset();
-	serial_set_baudrate(115200);
-	stm32w_bl_ping();
+	stm32w_enter_bl();
 
-	chars[16]=0;
-	
-	printf("%08x: ", addr);
+	metrics_phase_begin(PHASE_READ);
+	cache_open(use_cache && cache_overlaps(addr, length));
+	fflush(stdout);
 	while (left>0) {
-		if (stm32w_bl_read_mem(addr+length-left, data, (left>96) ? 96 : left)<0) {
+		n = (left>96) ? 96 : left;
+		if (cache_read(addr+length-left, data, n)<0) {
 			printf("\nMemory read error in %u byte block starting at 0x%08x\n", 
-				(left>96) ? 96 : left, addr + length - left);
+				n, addr + length - left);
 			exit(1);
 		}
-		for(i=0;i<((left>96) ? 96 : left);i++) {
-			printf("%02x ", data[i]);
-			chars[i%16]  = ((data[i]<0x20) || (data[i]>0x7e)) ? '.':data[i];
-			if(!((i+1)%8))
-				printf(" ");
-			if(!((i+1)%16)) {
-				printf("%s", chars);
-				if(left-i-1)
-					printf("\n%08x: ", addr + length - left + i + 1);
-				
-			}
+		metrics_add_bytes(n);
+		if (hexdump_write(STDOUT_FILENO, addr+length-left, data, n)) {
+			fprintf(stderr, "Failed to write dump output\n");
+			exit(1);
 		}
-		left -= ((left>96) ? 96 : left);
+		left -= n;
 	}
-	chars[i%16] = 0;
-	while (((i++))%16) {
-		printf("   ");
-		if((i%16)==8)
-			printf(" ");
-	}
-	printf(" %s\n", chars);
+	cache_close();
+	metrics_phase_end();
 	return 0;
 }
 
@@ -208,25 +257,112 @@ void help()
 	printf("   -a <addr>            Start address\n");
 	printf("   -l <len>             Length\n");
 	printf(" -b <file>              Write boot loader to STM32F interface\n");
+	printf(" -u <file>              Back up STM32F interface firmware to file\n");
 	printf(" -f <file> [-a addr]    Write application to STM32W flash\n");
 	printf(" -i                     Display device device information\n");
+	printf(" -p <file> [-a addr]    Patch flash with file contents\n");
+	printf(" --patch-csv <file>     Patch flash with rows for this device's EUI-64\n");
+	printf(" --watch <file>         Write application, then rewrite changed pages\n");
+	printf("                        on every change of the file (-a addr)\n");
+	printf(" --make-bundle <file> <type:file[:arg]> ...\n");
+	printf("                        Create deployment bundle, artifacts are\n");
+	printf("                        bridge:<file>[:version],\n");
+	printf("                        app:<file>[:addr[:version]] and\n");
+	printf("                        blob:<file>:<addr>[:version]\n");
+	printf(" --deploy <file>        Write all artifacts of a bundle in one pass\n");
+	printf(" --console <baud>       Show application UART output, after -f, -p,\n");
+	printf("                        --patch-csv and --deploy the application is\n");
+	printf("                        started\n");
+	printf(" --list                 List attached STM32F interfaces\n");
 	printf(" -h                     This help\n");
+	printf("\nOptions:\n");
+	printf(" --metrics-fd <fd>      Write JSON-lines metric events to fd\n");
+	printf(" --prom-file <file>     Write Prometheus textfile metrics\n");
+	printf(" --dry-run              Plan -f without touching the device\n");
+	printf(" --model <file>         Timing model from a previous --prom-file\n");
+	printf(" --record <file>        Record USB session to file\n");
+	printf(" --replay <file>        Replay recorded USB session at recorded timing\n");
+	printf(" --replay-fast <file>   Replay recorded USB session without delays\n");
+	printf(" --console-log <file>   Append console output to file\n");
+	printf(" --if-needed            Skip -b if the bridge already runs that version\n");
+	printf(" --bl-version <ver>     Version of the -b image, e.g. 2.0.6\n");
+	printf(" --no-cache             Read FIB and CIB from the device for -i and -d\n");
+	printf(" --port <path>          Use the interface at USB port path, e.g. 1-2.3\n");
+	printf(" --serial <serial>      Use the interface with USB serial number\n");
 }
 
+enum {
+	OPT_METRICS_FD = 256,
+	OPT_PROM_FILE,
+	OPT_DRY_RUN,
+	OPT_MODEL,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_REPLAY_FAST,
+	OPT_CONSOLE,
+	OPT_CONSOLE_LOG,
+	OPT_IF_NEEDED,
+	OPT_BL_VERSION,
+	OPT_NO_CACHE,
+	OPT_PORT,
+	OPT_SERIAL,
+};
+
+static struct option long_options[] = {
+	{"patch-csv", required_argument, NULL, 'P'},
+	{"watch", required_argument, NULL, 'W'},
+	{"make-bundle", required_argument, NULL, 'M'},
+	{"deploy", required_argument, NULL, 'D'},
+	{"list", no_argument, NULL, 'L'},
+	{"metrics-fd", required_argument, NULL, OPT_METRICS_FD},
+	{"prom-file", required_argument, NULL, OPT_PROM_FILE},
+	{"dry-run", no_argument, NULL, OPT_DRY_RUN},
+	{"model", required_argument, NULL, OPT_MODEL},
+	{"record", required_argument, NULL, OPT_RECORD},
+	{"replay", required_argument, NULL, OPT_REPLAY},
+	{"replay-fast", required_argument, NULL, OPT_REPLAY_FAST},
+	{"console", required_argument, NULL, OPT_CONSOLE},
+	{"console-log", required_argument, NULL, OPT_CONSOLE_LOG},
+	{"if-needed", no_argument, NULL, OPT_IF_NEEDED},
+	{"bl-version", required_argument, NULL, OPT_BL_VERSION},
+	{"no-cache", no_argument, NULL, OPT_NO_CACHE},
+	{"port", required_argument, NULL, OPT_PORT},
+	{"serial", required_argument, NULL, OPT_SERIAL},
+	{NULL, 0, NULL, 0}
+};
+
 int main(int argc, char **argv)
 {
-	char op;
+	int op;
 	char action = 0;
 	char *filename = NULL;
 	uint32_t addr = 0x08000000;
 	uint32_t len = 32;
+	int metrics_fd = -1;
+	char *prom_file = NULL;
+	char *model_file = NULL;
+	int dry_run = 0;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	int replay_realtime = 0;
+	uint32_t console_baud = 0;
+	char *console_log = NULL;
+	int if_needed = 0;
+	char *bl_version = NULL;
+	char version[32];
+	int use_cache = 1;
+	char *usb_port = NULL;
+	char *usb_serial = NULL;
 	extern char *optarg;
 
 	printf("flash32w STM32W Flasher v1.0 (c) 2012 Damjan Marion \n\n");
 
-	while ((op = getopt(argc, argv, "a:b:df:hil:")) != EOF) {
+	while ((op = getopt_long(argc, argv, "a:b:df:hil:p:u:", long_options,
+		NULL)) != EOF) {
 		switch (op) {
 		case 'b': case 'f': case 'd': case 'h': case 'i':
+		case 'p': case 'P': case 'W': case 'u': case 'M': case 'D':
+		case 'L':
 			if(action == 0) {
 				action = op;
 				filename = optarg;
@@ -261,16 +397,105 @@ int main(int argc, char **argv)
 				} 
 			}
 			break;
+		case OPT_METRICS_FD:
+			if(sscanf(optarg, "%d", &metrics_fd)!=1 ||
+				fcntl(metrics_fd, F_GETFD) < 0) {
+				printf("Wrong metrics file descriptor.\n");
+				exit(1);
+			}
+			break;
+		case OPT_PROM_FILE:
+			prom_file = optarg;
+			break;
+		case OPT_DRY_RUN:
+			dry_run = 1;
+			break;
+		case OPT_MODEL:
+			model_file = optarg;
+			break;
+		case OPT_RECORD:
+			record_file = optarg;
+			break;
+		case OPT_REPLAY: case OPT_REPLAY_FAST:
+			replay_file = optarg;
+			replay_realtime = (op == OPT_REPLAY);
+			break;
+		case OPT_CONSOLE:
+			if(sscanf(optarg, "%u", &console_baud)!=1 ||
+				console_baud == 0) {
+				printf("Wrong baud rate value.\n");
+				exit(1);
+			}
+			break;
+		case OPT_CONSOLE_LOG:
+			console_log = optarg;
+			break;
+		case OPT_IF_NEEDED:
+			if_needed = 1;
+			break;
+		case OPT_BL_VERSION:
+			bl_version = optarg;
+			break;
+		case OPT_NO_CACHE:
+			use_cache = 0;
+			break;
+		case OPT_PORT:
+			usb_port = optarg;
+			break;
+		case OPT_SERIAL:
+			usb_serial = optarg;
+			break;
 		default:
 			break;
 		}
 	}
 
+	if ((action == 0) && console_baud)
+		action = 'C';
+
 	if ((action == 0) || (action == 'h')) {
 		help();
 		exit(1);
 	}
 
+	if (console_baud && !strchr("CfpPD", action)) {
+		printf("--console can be combined only with -f, -p, --patch-csv and --deploy\n");
+		exit(1);
+	}
+
+	/* bundles are built offline */
+	if (action == 'M')
+		return bundle_create(filename, argc - optind, argv + optind);
+
+	if (action == 'L')
+		return stm32f_usb_list();
+	stm32f_usb_select(usb_port, usb_serial);
+
+	if (if_needed && (action == 'b') && !bl_version &&
+		!(bl_version = stm32f_image_version(filename, version,
+		sizeof(version)))) {
+		printf("Unknown version of %s, use --bl-version or %s.version\n",
+			filename, filename);
+		exit(1);
+	}
+
+	if (dry_run) {
+		if (action != 'f') {
+			printf("Dry run is supported only with -f\n");
+			exit(1);
+		}
+		return flash_app_dry_run(addr, filename, model_file);
+	}
+
+	/* recorded sessions must not depend on the cache contents */
+	if (replay_file || record_file)
+		use_cache = 0;
+
+	metrics_init(metrics_fd, prom_file);
+	if (replay_file)
+		replay_start(replay_file, replay_realtime);
+	if (record_file)
+		record_start(record_file);
 	serial_open();
 
 	switch (action) {
@@ -278,14 +503,44 @@ int main(int argc, char **argv)
 			flash_app(addr, filename);
 			break;
 		case 'b':
+			if (if_needed && stm32f_app_version_is(bl_version)) {
+				printf("STM32F firmware is up to date, skipping.\n");
+				break;
+			}
 			stm32f_write_bl(filename);
 			break;
+		case 'u':
+			stm32f_read_bl(filename);
+			break;
 		case 'd':
-			dump_mem(addr, len);
+			dump_mem(addr, len, use_cache);
 			break;
 		case 'i':
-			stm32w_info();
+			stm32w_info(use_cache);
+			break;
+		case 'p':
+			patch_file(addr, filename);
+			break;
+		case 'P':
+			patch_csv(filename);
+			break;
+		case 'W':
+			watch_app(addr, filename);
 			break;
+		case 'D':
+			bundle_deploy(filename);
+			break;
+	}
+
+	metrics_finish(0);
+
+	if (console_baud) {
+		if (action != 'C') {
+			/* start the application right before attaching */
+			serial_set_baudrate(50);
+			stm32w_run();
+		}
+		console_run(console_baud, console_log);
 	}
 	serial_close();
 	return 0;
@@ -0,0 +1,279 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "flash32w.h"
+
+struct counters {
+	double duration;
+	uint64_t bytes;
+	uint32_t retries;
+	uint32_t nacks;
+	uint32_t usb_xfers;
+	uint64_t usb_bytes;
+	uint32_t erased;
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	"none", "reset", "erase", "write", "verify", "ymodem", "read"
+};
+
+static int json_fd = -1;
+static char *prom_file;
+static int finished;
+static int cur_phase = PHASE_NONE;
+static double run_start, phase_start;
+static struct counters run, snap;
+static struct counters phases[PHASE_MAX];
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double throughput(struct counters *c)
+{
+	return (c->duration > 0) ? c->bytes / c->duration : 0;
+}
+
+static void json_event(const char *event, const char *key, const char *value,
+	struct counters *c)
+{
+	char line[512];
+	int n;
+
+	if (json_fd < 0)
+		return;
+
+	n = snprintf(line, sizeof(line), "{\"ts\":%.3f,\"event\":\"%s\","
+		"\"%s\":\"%s\",\"duration\":%.6f,\"bytes\":%llu,"
+		"\"throughput\":%.1f,\"retries\":%u,\"nacks\":%u,"
+		"\"usb_xfers\":%u,\"usb_bytes\":%llu,\"erased_pages\":%u}\n",
+		wall_time(), event, key, value, c->duration,
+		(unsigned long long) c->bytes, throughput(c), c->retries,
+		c->nacks, c->usb_xfers, (unsigned long long) c->usb_bytes,
+		c->erased);
+
+	/* one write per event so concurrent readers never see partial lines */
+	if (write(json_fd, line, n) != n)
+		json_fd = -1;
+}
+
+static void prom_metric(FILE *f, const char *name, const char *help)
+{
+	fprintf(f, "# HELP flash32w_%s %s\n", name, help);
+	fprintf(f, "# TYPE flash32w_%s gauge\n", name);
+}
+
+static void prom_phases(FILE *f, const char *name, const char *help, int field)
+{
+	struct counters *c;
+	int i;
+
+	prom_metric(f, name, help);
+	for (i = PHASE_NONE + 1; i < PHASE_MAX; i++) {
+		c = &phases[i];
+		fprintf(f, "flash32w_%s{phase=\"%s\"} ", name, phase_names[i]);
+		switch (field) {
+		case 0: fprintf(f, "%.6f\n", c->duration); break;
+		case 1: fprintf(f, "%llu\n", (unsigned long long) c->bytes); break;
+		case 2: fprintf(f, "%.1f\n", throughput(c)); break;
+		case 3: fprintf(f, "%u\n", c->retries); break;
+		case 4: fprintf(f, "%u\n", c->nacks); break;
+		case 5: fprintf(f, "%u\n", c->usb_xfers); break;
+		case 6: fprintf(f, "%llu\n", (unsigned long long) c->usb_bytes); break;
+		case 7: fprintf(f, "%u\n", c->erased); break;
+		}
+	}
+}
+
+static void prom_dump(int status)
+{
+	char tmp[1024];
+	FILE *f;
+
+	if (!prom_file)
+		return;
+
+	/* node_exporter may read at any time, so replace the file atomically */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", prom_file);
+	if (!(f = fopen(tmp, "w"))) {
+		fprintf(stderr, "Cannot write metrics to %s\n", tmp);
+		return;
+	}
+
+	prom_phases(f, "phase_duration_seconds", "Time spent in phase.", 0);
+	prom_phases(f, "phase_bytes",
+		"Payload bytes handled in phase, erased area for erase.", 1);
+	prom_phases(f, "phase_throughput_bytes_per_second",
+		"Payload throughput of phase.", 2);
+	prom_phases(f, "phase_retries", "Retried requests in phase.", 3);
+	prom_phases(f, "phase_nacks", "NACKs received in phase.", 4);
+	prom_phases(f, "phase_usb_transfers", "USB transfers in phase.", 5);
+	prom_phases(f, "phase_usb_bytes", "Bytes on the USB link in phase.", 6);
+	prom_phases(f, "phase_erased_pages", "Flash pages erased in phase.", 7);
+
+	prom_metric(f, "run_duration_seconds", "Duration of the last run.");
+	fprintf(f, "flash32w_run_duration_seconds %.6f\n", run.duration);
+	prom_metric(f, "run_bytes",
+		"Payload bytes written, read or sent by the last run.");
+	fprintf(f, "flash32w_run_bytes %llu\n", (unsigned long long) run.bytes);
+	prom_metric(f, "run_throughput_bytes_per_second",
+		"Payload throughput of the last run.");
+	fprintf(f, "flash32w_run_throughput_bytes_per_second %.1f\n",
+		throughput(&run));
+	prom_metric(f, "run_retries", "Retried requests in the last run.");
+	fprintf(f, "flash32w_run_retries %u\n", run.retries);
+	prom_metric(f, "run_nacks", "NACKs received in the last run.");
+	fprintf(f, "flash32w_run_nacks %u\n", run.nacks);
+	prom_metric(f, "run_usb_transfers", "USB transfers in the last run.");
+	fprintf(f, "flash32w_run_usb_transfers %u\n", run.usb_xfers);
+	prom_metric(f, "run_usb_bytes", "Bytes on the USB link in the last run.");
+	fprintf(f, "flash32w_run_usb_bytes %llu\n",
+		(unsigned long long) run.usb_bytes);
+	prom_metric(f, "run_erased_pages", "Flash pages erased by the last run.");
+	fprintf(f, "flash32w_run_erased_pages %u\n", run.erased);
+	prom_metric(f, "run_success", "1 if the last run succeeded.");
+	fprintf(f, "flash32w_run_success %u\n", status ? 0 : 1);
+	prom_metric(f, "run_timestamp_seconds", "Completion time of the last run.");
+	fprintf(f, "flash32w_run_timestamp_seconds %llu\n",
+		(unsigned long long) time(NULL));
+
+	fclose(f);
+	if (rename(tmp, prom_file))
+		fprintf(stderr, "Cannot write metrics to %s\n", prom_file);
+}
+
+static void metrics_atexit()
+{
+	/* every exit(1) on a protocol error ends up here */
+	metrics_finish(1);
+}
+
+int metrics_init(int fd, char *prom)
+{
+	json_fd = fd;
+	prom_file = prom;
+	run_start = now();
+	atexit(metrics_atexit);
+	return 0;
+}
+
+void metrics_phase_begin(int phase)
+{
+	if (cur_phase != PHASE_NONE)
+		metrics_phase_end();
+	cur_phase = phase;
+	snap = run;
+	phase_start = now();
+}
+
+void metrics_phase_end()
+{
+	struct counters d;
+	struct counters *p;
+
+	if (cur_phase == PHASE_NONE)
+		return;
+
+	d.duration = now() - phase_start;
+	d.bytes = run.bytes - snap.bytes;
+	d.retries = run.retries - snap.retries;
+	d.nacks = run.nacks - snap.nacks;
+	d.usb_xfers = run.usb_xfers - snap.usb_xfers;
+	d.usb_bytes = run.usb_bytes - snap.usb_bytes;
+	d.erased = run.erased - snap.erased;
+	/* erase moves no payload, its bytes are the erased area */
+	d.bytes += d.erased * FLASH_PAGE_SIZE;
+
+	p = &phases[cur_phase];
+	p->duration += d.duration;
+	p->bytes += d.bytes;
+	p->retries += d.retries;
+	p->nacks += d.nacks;
+	p->usb_xfers += d.usb_xfers;
+	p->usb_bytes += d.usb_bytes;
+	p->erased += d.erased;
+
+	json_event("phase", "phase", phase_names[cur_phase], &d);
+	cur_phase = PHASE_NONE;
+}
+
+void metrics_add_bytes(uint32_t n)
+{
+	run.bytes += n;
+}
+
+void metrics_add_erased(uint32_t pages)
+{
+	run.erased += pages;
+}
+
+void metrics_retry()
+{
+	run.retries++;
+}
+
+void metrics_nack()
+{
+	run.nacks++;
+}
+
+void metrics_usb_xfer(uint32_t len)
+{
+	run.usb_xfers++;
+	run.usb_bytes += len;
+}
+
+void metrics_finish(int status)
+{
+	if (finished)
+		return;
+	finished = 1;
+
+	metrics_phase_end();
+	run.duration = now() - run_start;
+	json_event("run", "status", status ? "fail" : "ok", &run);
+	prom_dump(status);
+}
@@ -0,0 +1,278 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <ctype.h>
+
+
+#include "flash32w.h"
+
+#define MAX_PATCHES	64
+#define MAX_PATCH_SIZE	FLASH_SIZE
+
+struct patch {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t *data;
+};
+
+static struct patch patches[MAX_PATCHES];
+static int npatches;
+static uint8_t image[FLASH_PAGES][FLASH_PAGE_SIZE];
+static uint8_t orig[FLASH_PAGES][FLASH_PAGE_SIZE];
+
+static void patch_add(uint32_t addr, uint8_t *data, uint32_t len)
+{
+	if (npatches == MAX_PATCHES) {
+		printf("Too many patches\n");
+		exit(1);
+	}
+	if (!plan_fits(addr, len)) {
+		printf("Patch at 0x%08x (%u bytes) is outside of flash\n",
+			addr, len);
+		exit(1);
+	}
+	patches[npatches].addr = addr;
+	patches[npatches].len = len;
+	patches[npatches].data = data;
+	npatches++;
+}
+
+/*
+ * Read the pages touched by the patches, merge the patches in memory and
+ * erase and rewrite only pages whose content changed.
+ */
+static int patch_apply()
+{
+	struct flash_plan touched, p;
+	uint32_t a, pg;
+	int i, j;
+
+	plan_init(&touched);
+	for (i = 0; i < npatches; i++)
+		for (a = patches[i].addr & ~(FLASH_PAGE_SIZE - 1);
+			a < patches[i].addr + patches[i].len; a += FLASH_PAGE_SIZE)
+			plan_add_page(&touched, (a - FLASH_BASE) / FLASH_PAGE_SIZE);
+
+	metrics_phase_begin(PHASE_READ);
+	printf("Reading flash pages ");
+	plan_print_pages(&touched);
+	printf(" ...");
+	fflush(stdout);
+	for (i = 0; i < touched.npages; i++) {
+		pg = touched.pages[i];
+		if (stm32w_read(FLASH_BASE + pg * FLASH_PAGE_SIZE, orig[pg],
+			FLASH_PAGE_SIZE)) {
+			printf("\nFailed to read page %u\n", pg);
+			exit(1);
+		}
+		metrics_add_bytes(FLASH_PAGE_SIZE);
+		memcpy(image[pg], orig[pg], FLASH_PAGE_SIZE);
+	}
+	printf(", done.\n");
+
+	for (i = 0; i < npatches; i++)
+		for (a = 0; a < patches[i].len; a++) {
+			pg = (patches[i].addr + a - FLASH_BASE) / FLASH_PAGE_SIZE;
+			image[pg][(patches[i].addr + a) % FLASH_PAGE_SIZE] =
+				patches[i].data[a];
+		}
+
+	plan_init(&p);
+	for (i = 0; i < touched.npages; i++) {
+		pg = touched.pages[i];
+		if (memcmp(image[pg], orig[pg], FLASH_PAGE_SIZE))
+			plan_add_page(&p, pg);
+	}
+
+	if (p.npages == 0) {
+		printf("Flash content already matches, nothing to do.\n");
+		metrics_phase_end();
+		return 0;
+	}
+
+	metrics_phase_begin(PHASE_ERASE);
+	printf("Erasing flash pages ");
+	plan_print_pages(&p);
+	printf(" ...");
+	if (plan_erase(&p)) {
+		printf("Failed to erase flash.\n");
+		exit(1);
+	}
+	printf(", done.\n");
+
+	metrics_phase_begin(PHASE_WRITE);
+	printf("Writing flash pages ...");
+	fflush(stdout);
+	for (i = 0; i < p.npages; i++) {
+		pg = p.pages[i];
+		for (j = 0; j < FLASH_PAGE_SIZE; j += WRITE_BLOCK_SIZE) {
+			if (plan_block_empty(image[pg] + j))
+				continue;
+			a = FLASH_BASE + pg * FLASH_PAGE_SIZE + j;
+			if (stm32w_bl_write_mem(a, image[pg] + j,
+				WRITE_BLOCK_SIZE)) {
+				printf("\nFailed to write block to address 0x%08x\n",
+					a);
+				exit(1);
+			}
+			metrics_add_bytes(WRITE_BLOCK_SIZE);
+		}
+	}
+	printf(", done.\n");
+
+	metrics_phase_begin(PHASE_VERIFY);
+	printf("Verifying ...");
+	fflush(stdout);
+	for (i = 0; i < p.npages; i++) {
+		pg = p.pages[i];
+		if (stm32w_read(FLASH_BASE + pg * FLASH_PAGE_SIZE, orig[pg],
+			FLASH_PAGE_SIZE) ||
+			memcmp(image[pg], orig[pg], FLASH_PAGE_SIZE)) {
+			printf("\nVerification of page %u failed\n", pg);
+			exit(1);
+		}
+		metrics_add_bytes(FLASH_PAGE_SIZE);
+	}
+	printf(", done.\n");
+	metrics_phase_end();
+	return 0;
+}
+
+int patch_file(uint32_t addr, char *filename)
+{
+	static uint8_t data[MAX_PATCH_SIZE];
+	int fd, len;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+	len = read(fd, data, sizeof(data));
+	close(fd);
+	if (len <= 0) {
+		printf("Cannot read file %s\n", filename);
+		exit(1);
+	}
+
+	patch_add(addr, data, len);
+	printf("Patching %i bytes from %s at 0x%08x\n", len, filename, addr);
+	stm32w_enter_bl();
+	return patch_apply();
+}
+
+static int parse_hex(char *s, uint8_t *out, int max)
+{
+	int n = 0;
+	unsigned int v;
+
+	while (*s) {
+		if (*s == ':' || *s == '-' || isspace((unsigned char) *s)) {
+			s++;
+			continue;
+		}
+		if ((n == max) || !isxdigit((unsigned char) s[0]) ||
+			!isxdigit((unsigned char) s[1]) ||
+			(sscanf(s, "%2x", &v) != 1))
+			return -1;
+		out[n++] = v;
+		s += 2;
+	}
+	return n;
+}
+
+/*
+ * CSV rows: eui64,address,hexdata
+ * EUI-64 is written as shown by -i, e.g. 00:80:e1:02:00:1d:3a:5c.
+ */
+int patch_csv(char *filename)
+{
+	char line[4096], *eui_s, *addr_s, *data_s;
+	uint8_t eui[8], row_eui[8], buff[8];
+	uint8_t *data;
+	uint32_t addr;
+	int i, n, lineno = 0;
+	FILE *f;
+
+	if (!(f = fopen(filename, "r"))) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+
+	stm32w_enter_bl();
+	if (stm32w_bl_read_mem(0x080407A2, buff, 8)) {
+		printf("Cannot read EUI-64 address\n");
+		exit(1);
+	}
+	for (i = 0; i < 8; i++)
+		eui[i] = buff[7 - i];
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+		eui_s = strtok(line, ",");
+		addr_s = strtok(NULL, ",");
+		data_s = strtok(NULL, ",\r\n");
+		if (!eui_s || !addr_s || !data_s ||
+			parse_hex(eui_s, row_eui, 8) != 8) {
+			/* tolerate a header row */
+			if (lineno == 1)
+				continue;
+			printf("%s:%i: malformed patch row\n", filename, lineno);
+			exit(1);
+		}
+		if (memcmp(eui, row_eui, 8))
+			continue;
+
+		addr = strtoul(addr_s, NULL, 0);
+		if (!(data = malloc(strlen(data_s) / 2 + 1)) ||
+			(n = parse_hex(data_s, data, strlen(data_s) / 2)) <= 0) {
+			printf("%s:%i: malformed patch data\n", filename, lineno);
+			exit(1);
+		}
+		patch_add(addr, data, n);
+		printf("Patching %i bytes at 0x%08x\n", n, addr);
+	}
+	fclose(f);
+
+	if (npatches == 0) {
+		printf("No patches for device ");
+		for (i = 0; i < 7; i++)
+			printf("%02x:", eui[i]);
+		printf("%02x in %s\n", eui[7], filename);
+		exit(1);
+	}
+	return patch_apply();
+}
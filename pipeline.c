@@ -0,0 +1,130 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#include "flash32w.h"
+
+/*
+ * Image reading, padding and frame building run in a producer thread
+ * while the device is being reset, synced and erased. The transport
+ * takes ready frames from a bounded ring.
+ */
+
+#define PIPELINE_DEPTH	16
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct write_frame frames[PIPELINE_DEPTH];
+static int head, tail, count, done;
+static int image_fd;
+static struct flash_plan *plan;
+
+static void *producer(void *arg)
+{
+	uint8_t buff[WRITE_BLOCK_SIZE];
+	int i;
+
+	for (i = 0; i < plan->nblocks; i++) {
+		memset(buff, 0xFF, WRITE_BLOCK_SIZE);
+		if (read(image_fd, buff, WRITE_BLOCK_SIZE) <= 0)
+			break;
+
+		pthread_mutex_lock(&lock);
+		while (count == PIPELINE_DEPTH)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+
+		/* slot at head is not visible to the consumer until count++ */
+		stm32w_bl_write_prepare(&frames[head], plan->blocks[i], buff,
+			WRITE_BLOCK_SIZE);
+		head = (head + 1) % PIPELINE_DEPTH;
+
+		pthread_mutex_lock(&lock);
+		count++;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	pthread_mutex_lock(&lock);
+	done = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int pipeline_start(int fd, struct flash_plan *p)
+{
+	image_fd = fd;
+	plan = p;
+	head = tail = count = done = 0;
+
+	if (pthread_create(&thread, NULL, producer, NULL)) {
+		printf("Failed to start image pipeline\n");
+		exit(1);
+	}
+	return 0;
+}
+
+/* Next frame in plan order, NULL when the image is exhausted */
+struct write_frame *pipeline_get()
+{
+	struct write_frame *f = NULL;
+
+	pthread_mutex_lock(&lock);
+	while (count == 0 && !done)
+		pthread_cond_wait(&cond, &lock);
+	if (count)
+		f = &frames[tail];
+	pthread_mutex_unlock(&lock);
+	return f;
+}
+
+/* Give the frame returned by pipeline_get() back to the producer */
+void pipeline_release()
+{
+	tail = (tail + 1) % PIPELINE_DEPTH;
+
+	pthread_mutex_lock(&lock);
+	count--;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void pipeline_finish()
+{
+	pthread_join(thread, NULL);
+}
@@ -0,0 +1,215 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "flash32w.h"
+
+/* USB transfers and bytes on the wire of one bootloader command */
+#define WRITE_XFERS	6
+#define WRITE_FRAMING	(2 + 1 + 5 + 1 + 2 + 1)
+#define ERASE_XFERS	4
+#define ERASE_FRAMING	(2 + 1 + 2 + 1)
+
+/* reset: 2x set_baudrate, 5 bridge commands, ping */
+#define RESET_XFERS	(2 * 2 + 5 * 2 + 2)
+#define RESET_BYTES	(2 * 7 + 5 * (5 + 4) + 2)
+
+void plan_init(struct flash_plan *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+/* written so that addr + size can not wrap around */
+int plan_fits(uint32_t addr, uint32_t size)
+{
+	return (addr >= FLASH_BASE) && (size != 0) &&
+		(addr - FLASH_BASE <= FLASH_SIZE) &&
+		(size <= FLASH_SIZE - (addr - FLASH_BASE));
+}
+
+int plan_add_image(struct flash_plan *p, uint32_t addr, uint32_t size)
+{
+	uint32_t i, pg;
+
+	if (!plan_fits(addr, size))
+		return -1;
+
+	for (i = 0; i < size; i += WRITE_BLOCK_SIZE) {
+		if (p->nblocks == MAX_WRITE_BLOCKS)
+			return -1;
+		p->blocks[p->nblocks++] = addr + i;
+	}
+
+	for (pg = (addr - FLASH_BASE) / FLASH_PAGE_SIZE;
+		pg <= (addr + size - 1 - FLASH_BASE) / FLASH_PAGE_SIZE; pg++)
+		plan_add_page(p, pg);
+	return 0;
+}
+
+void plan_add_page(struct flash_plan *p, uint32_t pg)
+{
+	int i;
+
+	if ((pg >= FLASH_PAGES) || p->erase[pg])
+		return;
+	p->erase[pg] = 1;
+
+	/* keep the page list sorted */
+	p->npages = 0;
+	for (i = 0; i < FLASH_PAGES; i++)
+		if (p->erase[i])
+			p->pages[p->npages++] = i;
+}
+
+/* erased flash already reads as 0xFF, such blocks need no write */
+int plan_block_empty(uint8_t *data)
+{
+	int i;
+
+	for (i = 0; i < WRITE_BLOCK_SIZE; i++)
+		if (data[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+int plan_erase(struct flash_plan *p)
+{
+	if (p->npages == 0)
+		return 0;
+	if (stm32w_bl_erase_pages(p->pages, p->npages))
+		return -1;
+	metrics_add_erased(p->npages);
+	return 0;
+}
+
+void plan_print_pages(struct flash_plan *p)
+{
+	int i, first;
+
+	for (i = 0; i < p->npages; i++) {
+		first = i;
+		while ((i + 1 < p->npages) && (p->pages[i + 1] == p->pages[i] + 1))
+			i++;
+		printf("%s%u", first ? "," : "", p->pages[first]);
+		if (i != first)
+			printf("-%u", p->pages[i]);
+	}
+}
+
+void model_init(struct link_model *m)
+{
+	m->latency = 0.001;
+	m->bandwidth = 115200 / 10;
+	m->page_erase = 0.020;
+	m->reset = 0.250;
+}
+
+int model_load(struct link_model *m, char *filename)
+{
+	struct {
+		double duration, bytes, xfers, usb_bytes;
+	} ph[PHASE_MAX];
+	char line[256], name[64], phase[16];
+	double v, t;
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(filename, "r")))
+		return -1;
+
+	memset(ph, 0, sizeof(ph));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "flash32w_phase_%63[a-z_]{phase=\"%15[a-z]\"} %lf",
+			name, phase, &v) != 3)
+			continue;
+		if (!strcmp(phase, "reset"))
+			i = PHASE_RESET;
+		else if (!strcmp(phase, "erase"))
+			i = PHASE_ERASE;
+		else if (!strcmp(phase, "write"))
+			i = PHASE_WRITE;
+		else
+			continue;
+		if (!strcmp(name, "duration_seconds"))
+			ph[i].duration = v;
+		else if (!strcmp(name, "bytes"))
+			ph[i].bytes = v;
+		else if (!strcmp(name, "usb_transfers"))
+			ph[i].xfers = v;
+		else if (!strcmp(name, "usb_bytes"))
+			ph[i].usb_bytes = v;
+	}
+	fclose(f);
+
+	/* bandwidth is fixed by the UART, the rest is fitted to the last run */
+	if (ph[PHASE_RESET].duration > 0)
+		m->reset = ph[PHASE_RESET].duration;
+
+	if (ph[PHASE_WRITE].xfers > 0) {
+		t = ph[PHASE_WRITE].duration -
+			ph[PHASE_WRITE].usb_bytes / m->bandwidth;
+		if (t > 0)
+			m->latency = t / ph[PHASE_WRITE].xfers;
+	}
+
+	if (ph[PHASE_ERASE].bytes > 0) {
+		t = ph[PHASE_ERASE].duration -
+			ph[PHASE_ERASE].xfers * m->latency -
+			ph[PHASE_ERASE].usb_bytes / m->bandwidth;
+		if (t > 0)
+			m->page_erase = t / (ph[PHASE_ERASE].bytes / FLASH_PAGE_SIZE);
+	}
+	return 0;
+}
+
+void plan_estimate(struct flash_plan *p, struct link_model *m,
+	struct plan_cost *c)
+{
+	double erase_bytes, write_bytes;
+
+	memset(c, 0, sizeof(*c));
+	c->payload = p->nblocks * WRITE_BLOCK_SIZE;
+
+	erase_bytes = p->npages ? ERASE_FRAMING + p->npages : 0;
+	write_bytes = p->nblocks * (WRITE_FRAMING + WRITE_BLOCK_SIZE);
+	c->wire_bytes = RESET_BYTES + erase_bytes + write_bytes;
+	c->xfers = RESET_XFERS + (p->npages ? ERASE_XFERS : 0) +
+		p->nblocks * WRITE_XFERS;
+
+	c->reset = m->reset;
+	c->erase = p->npages ? ERASE_XFERS * m->latency +
+		erase_bytes / m->bandwidth + p->npages * m->page_erase : 0;
+	c->write = p->nblocks * WRITE_XFERS * m->latency +
+		write_bytes / m->bandwidth;
+}
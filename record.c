@@ -0,0 +1,365 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+
+#include "flash32w.h"
+
+/*
+ * Session log format: 8 byte magic followed by records of
+ *   type (1), timestamp in us since session start (8, LE),
+ *   length (2, LE), data (length)
+ * Data is the bytes sent, the bytes received, the 4 byte baud rate or the
+ * bytes of one read of a receive stream.
+ */
+
+#define REC_MAGIC	"F32WREC2"
+#define REC_HDR_SIZE	11
+
+enum {
+	REC_OPEN = 1,
+	REC_CLOSE,
+	REC_SEND,
+	REC_RECV,
+	REC_BAUD,
+	REC_STREAM,
+};
+
+static const char *rec_names[] = {
+	"?", "open", "close", "send", "recv", "baudrate", "stream"
+};
+
+static struct serial_ops *lower;
+static FILE *rec_file;
+static double start;
+
+/* replay state */
+static uint8_t *log_data;
+static uint32_t log_size, log_off, log_rec;
+static int log_realtime;
+static serial_rx_cb rx_cb;
+static pthread_t rx_thread;
+static volatile int rx_stopping;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rec_write(uint8_t type, uint8_t *data, int len)
+{
+	uint64_t ts = (now() - start) * 1e6;
+	uint8_t hdr[REC_HDR_SIZE];
+	int i;
+
+	hdr[0] = type;
+	for (i = 0; i < 8; i++)
+		hdr[1 + i] = ts >> (i * 8);
+	hdr[9] = len;
+	hdr[10] = len >> 8;
+	fwrite(hdr, sizeof(hdr), 1, rec_file);
+	if (len)
+		fwrite(data, len, 1, rec_file);
+}
+
+static int rec_open()
+{
+	int r = lower->open();
+	rec_write(REC_OPEN, NULL, 0);
+	return r;
+}
+
+static int rec_close()
+{
+	int r = lower->close();
+	rec_write(REC_CLOSE, NULL, 0);
+	fflush(rec_file);
+	return r;
+}
+
+static int rec_send(uint8_t *data, int length, int *transfered)
+{
+	int r = lower->send(data, length, transfered);
+	rec_write(REC_SEND, data, length);
+	return r;
+}
+
+static int rec_recv(uint8_t *data, int length, int *transfered)
+{
+	int r = lower->recv(data, length, transfered);
+	rec_write(REC_RECV, data, *transfered);
+	return r;
+}
+
+static int rec_set_baudrate(uint32_t b)
+{
+	uint8_t v[4] = {b, b >> 8, b >> 16, b >> 24};
+	int r = lower->set_baudrate(b);
+	rec_write(REC_BAUD, v, 4);
+	return r;
+}
+
+static int rec_sleep(uint32_t usec)
+{
+	return lower->sleep(usec);
+}
+
+static void rec_rx(uint8_t *data, int len)
+{
+	if (len >= 0)
+		rec_write(REC_STREAM, data, len);
+	rx_cb(data, len);
+}
+
+static int rec_rx_start(serial_rx_cb cb)
+{
+	rx_cb = cb;
+	return lower->rx_start(rec_rx);
+}
+
+static int rec_rx_stop()
+{
+	return lower->rx_stop();
+}
+
+static struct serial_ops record_ops = {
+	rec_open,
+	rec_close,
+	rec_send,
+	rec_recv,
+	rec_set_baudrate,
+	rec_sleep,
+	rec_rx_start,
+	rec_rx_stop,
+};
+
+int record_start(char *filename)
+{
+	if (!(rec_file = fopen(filename, "w"))) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+	fwrite(REC_MAGIC, 8, 1, rec_file);
+	start = now();
+	lower = serial;
+	serial = &record_ops;
+	return 0;
+}
+
+/* Return data of the next record, which must be of the given type */
+static uint8_t *replay_next(uint8_t type, int *len)
+{
+	uint8_t *hdr = log_data + log_off;
+	uint64_t ts = 0;
+	double d;
+	int i;
+
+	if ((log_off + REC_HDR_SIZE > log_size) || (hdr[0] != type)) {
+		printf("\nReplay diverged at record %u: expected %s, got %s\n",
+			log_rec, rec_names[type],
+			(log_off + REC_HDR_SIZE > log_size) ? "end of log" :
+			rec_names[(hdr[0] <= REC_STREAM) ? hdr[0] : 0]);
+		exit(1);
+	}
+
+	for (i = 7; i >= 0; i--)
+		ts = ts << 8 | hdr[1 + i];
+	*len = hdr[9] | hdr[10] << 8;
+	if (log_off + REC_HDR_SIZE + *len > log_size) {
+		printf("\nReplay log truncated at record %u\n", log_rec);
+		exit(1);
+	}
+
+	/* recorded timing: do not complete before the original did */
+	if (log_realtime) {
+		d = start + ts / 1e6 - now();
+		if (d > 0)
+			usleep(d * 1e6);
+	}
+
+	log_off += REC_HDR_SIZE + *len;
+	log_rec++;
+	return hdr + REC_HDR_SIZE;
+}
+
+static void replay_diverged(uint8_t type)
+{
+	printf("\nReplay diverged at record %u: %s differs from log\n",
+		log_rec - 1, rec_names[type]);
+	exit(1);
+}
+
+static int replay_open()
+{
+	int len;
+	replay_next(REC_OPEN, &len);
+	return 0;
+}
+
+static int replay_close()
+{
+	int len;
+	replay_next(REC_CLOSE, &len);
+	return 0;
+}
+
+static int replay_send(uint8_t *data, int length, int *transfered)
+{
+	uint8_t *d;
+	int len;
+
+	d = replay_next(REC_SEND, &len);
+	if ((len != length) || memcmp(d, data, len))
+		replay_diverged(REC_SEND);
+	*transfered = length;
+	metrics_usb_xfer(length);
+	return 0;
+}
+
+static int replay_recv(uint8_t *data, int length, int *transfered)
+{
+	uint8_t *d;
+	int len;
+
+	d = replay_next(REC_RECV, &len);
+	if (len > length)
+		replay_diverged(REC_RECV);
+	memcpy(data, d, len);
+	*transfered = len;
+	metrics_usb_xfer(len);
+	return 0;
+}
+
+static int replay_set_baudrate(uint32_t b)
+{
+	uint8_t *d;
+	int len;
+
+	d = replay_next(REC_BAUD, &len);
+	if ((len != 4) ||
+		(b != (d[0] | d[1] << 8 | d[2] << 16 | (uint32_t) d[3] << 24)))
+		replay_diverged(REC_BAUD);
+	metrics_usb_xfer(7);
+	metrics_usb_xfer(0);
+	return 0;
+}
+
+static int replay_sleep(uint32_t usec)
+{
+	/* recorded timestamps already include the sleeps */
+	return 0;
+}
+
+/* type of the next record, 0 at the end of the log */
+static int replay_peek()
+{
+	return (log_off + REC_HDR_SIZE <= log_size) ? log_data[log_off] : 0;
+}
+
+static void *replay_rx_thread(void *arg)
+{
+	uint8_t *d;
+	int len;
+
+	while (!rx_stopping && (replay_peek() == REC_STREAM)) {
+		d = replay_next(REC_STREAM, &len);
+		rx_cb(d, len);
+	}
+	if (!rx_stopping)
+		rx_cb(NULL, -1);
+	return NULL;
+}
+
+static int replay_rx_start(serial_rx_cb cb)
+{
+	rx_cb = cb;
+	rx_stopping = 0;
+	return pthread_create(&rx_thread, NULL, replay_rx_thread, NULL) ? -1 : 0;
+}
+
+static int replay_rx_stop()
+{
+	int len;
+
+	rx_stopping = 1;
+	pthread_join(rx_thread, NULL);
+	/* a stream stopped early skips the rest of its reads */
+	log_realtime = 0;
+	while (replay_peek() == REC_STREAM)
+		replay_next(REC_STREAM, &len);
+	return 0;
+}
+
+static struct serial_ops replay_ops = {
+	replay_open,
+	replay_close,
+	replay_send,
+	replay_recv,
+	replay_set_baudrate,
+	replay_sleep,
+	replay_rx_start,
+	replay_rx_stop,
+};
+
+int replay_start(char *filename, int realtime)
+{
+	struct stat s;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+	fstat(fd, &s);
+
+	log_size = s.st_size;
+	if (!(log_data = malloc(log_size)) ||
+		(read(fd, log_data, log_size) != log_size) ||
+		(log_size < 8) || memcmp(log_data, REC_MAGIC, 8)) {
+		printf("File %s is not a flash32w session log\n", filename);
+		exit(1);
+	}
+	close(fd);
+
+	log_off = 8;
+	log_realtime = realtime;
+	start = now();
+	serial = &replay_ops;
+	return 0;
+}
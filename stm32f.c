@@ -34,6 +34,7 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <libgen.h>
+#include <sys/mman.h>
 
 #include "flash32w.h"
 
@@ -88,24 +89,28 @@ int stm32f_cmd_2_1(uint8_t c1, uint8_t c2,  uint8_t *v)
 	return 0;
 }
 
+static uint16_t crc16_table[256];
+
 static uint16_t _calc_crc16(uint8_t *data, int count) 
 {
-	uint16_t crc = 0;
-	uint8_t i;
-
-	while(--count >= 0) {
-		crc = crc ^ (uint16_t) *data++ << 8;
-		for(i=0; i<8; ++i) {
-			if (crc & 0x8000)
-				crc = crc << 1 ^ 0x1021;
-			else
-				crc = crc << 1;
+	uint16_t crc;
+	int i, j;
+
+	if (!crc16_table[1]) {
+		for (i = 0; i < 256; i++) {
+			crc = i << 8;
+			for (j = 0; j < 8; j++)
+				crc = (crc & 0x8000) ? (crc << 1 ^ 0x1021) : (crc << 1);
+			crc16_table[i] = crc;
 		}
-	} 
+	}
+
+	crc = 0;
+	while(--count >= 0)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *data++];
 	return crc;
 }
 
-
 int ymodem_send_packet(uint8_t *buff)
 {
 	int length, t;
@@ -125,8 +130,11 @@ int ymodem_send_packet(uint8_t *buff)
 	while(1) {
 		serial_send(buff, length + 5, &t);
 		serial_recv(buff, MAX_XFER_SIZE, &t);
-		if(buff[0]==NAK)
+		if(buff[0]==NAK) {
+			metrics_nack();
+			metrics_retry();
 			continue;
+		}
 		if(buff[0]==ACK)
 			return 0;
 		printf("Failed to send YMODEM packet\n");
@@ -134,29 +142,17 @@ int ymodem_send_packet(uint8_t *buff)
 	}
 }
 
-int stm32f_write_bl(char *filename)
+static void stm32f_enter_bl()
 {
-	uint8_t cmd[] = {0xAA, 0x01, CMD_DOWNLOAD_IMAGE, 0x55};
-	int fd;
-	struct stat s;
 	uint8_t xx;
-	uint8_t buff[1030];
-	uint8_t pkt_cnt=0;
-	char *base_filename;
-	char *file_size;
-	int t,r;
+	int r;
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		printf("Cannot open file %s\n", filename);
-		exit(1);
-	}
-	fstat(fd, &s);
-	
+	metrics_phase_begin(PHASE_RESET);
 	serial_set_baudrate(10);
 
 	r = 100;
 	while(stm32f_cmd_1_1(CMD_GET_CODE_TYPE, &xx) != 0) {
+		metrics_retry();
 		if (!(r--)) {
 			printf("Failed to get into bootloader. Restart might help.\n");
 			exit(1);
@@ -168,14 +164,15 @@ int stm32f_write_bl(char *filename)
 		stm32f_cmd_1_1(CMD_RUN_BOOTLOADER, &xx);
 		serial_close();
 		printf("Waiting for device to reset...\n");
-		usleep(100000);
+		serial_sleep(100000);
 		serial_open();
 		serial_set_baudrate(10);
 	}
 
 	r = 100;
 	while(stm32f_cmd_1_1(CMD_GET_CODE_TYPE, &xx) != 0) {
-		usleep(100000);
+		metrics_retry();
+		serial_sleep(100000);
 		if (!(r--)) {
 			printf("Failed to get into bootloader. Restart might help.\n");
 			exit(1);
@@ -186,7 +183,97 @@ int stm32f_write_bl(char *filename)
 		printf("Failed to get into bootloader. Restart might help.\n");
 		exit(1);
 	}
+}
+
+int stm32f_run_app()
+{
+	uint8_t xx;
+
+	printf("Starting STM32F application...\n");
+	serial_set_baudrate(10);
+	stm32f_cmd_1_1(CMD_RUN_APPLICATION, &xx);
+	serial_close();
+	serial_sleep(100000);
+	serial_open();
+	return 0;
+}
+
+/*
+ * Version of a bridge firmware image, taken from the <file>.version
+ * sidecar. The image size is not enough: rebuilt or patched images may
+ * have the size of a known release.
+ */
+char *stm32f_image_version(char *filename, char *buff, int len)
+{
+	char name[1024];
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s.version", filename);
+	if (!(f = fopen(name, "r")))
+		return NULL;
+	if (!fgets(buff, len, f))
+		buff[0] = 0;
+	fclose(f);
+	buff[strcspn(buff, " \t\r\n")] = 0;
+	return buff[0] ? buff : NULL;
+}
+
+/*
+ * Returns 1 if the bridge runs an application whose version starts with
+ * the given dotted version (e.g. "2.0.6" matches 2.0.6.x), 0 otherwise.
+ */
+int stm32f_app_version_is(char *version)
+{
+	unsigned int v[4];
+	uint32_t x;
+	uint8_t xx;
+	int i, n, r;
+
+	n = sscanf(version, "%u.%u.%u.%u", &v[0], &v[1], &v[2], &v[3]);
+	if (n < 1) {
+		printf("Wrong version string %s\n", version);
+		exit(1);
+	}
+
+	serial_set_baudrate(10);
+	r = 100;
+	while(stm32f_cmd_1_1(CMD_GET_CODE_TYPE, &xx) != 0) {
+		metrics_retry();
+		if (!(r--)) {
+			printf("Failed to get STM32F code type.\n");
+			exit(1);
+		}
+	}
+
+	/* bridge sits in its bootloader, application must be written */
+	if (xx != 1)
+		return 0;
+
+	if (stm32f_cmd_1_4(CMD_GET_APP_VERSION, &x)) {
+		printf("Communication error\n");
+		exit(1);
+	}
+	printf("Running STM32F firmware %u.%u.%u.%u, image %s\n",
+		(x>>24) & 0xff, (x>>16) & 0xff, (x>>8) & 0xff, x & 0xff, version);
 
+	for (i = 0; i < n; i++)
+		if (((x >> (24 - 8 * i)) & 0xff) != v[i])
+			return 0;
+	return 1;
+}
+
+int stm32f_write_bl_data(char *name, uint8_t *data, uint32_t size)
+{
+	uint8_t cmd[] = {0xAA, 0x01, CMD_DOWNLOAD_IMAGE, 0x55};
+	uint8_t buff[1030];
+	uint8_t pkt_cnt=0;
+	uint32_t off;
+	char *file_size;
+	int t,r;
+
+	stm32f_enter_bl();
+
+	metrics_phase_begin(PHASE_YMODEM);
 	printf("Requesting YMODEM transfer ...\n");
 	serial_send(cmd, sizeof(cmd), &t);
 	printf("Waiting for handshake ...\n");
@@ -195,6 +282,7 @@ int stm32f_write_bl(char *filename)
 		serial_recv(buff, MAX_XFER_SIZE, &t);
 		if(buff[0]=='C')
 			break;
+		metrics_retry();
 		if (r--== 0) {
 			printf("Failed to get YMODEM response\n");
 			exit(1);
@@ -204,24 +292,22 @@ int stm32f_write_bl(char *filename)
 	/* packet 0 */
 	memset(buff, 0, sizeof(buff));
 	buff[0] = SOH;
-	base_filename = basename(filename);
-	file_size = strcpy((char *)buff+3, base_filename) + strlen(base_filename) + 1;
-	sprintf(file_size, "%d ", (int) s.st_size);
-	printf("Flashing %u bytes from file %s ... \n", (int) s.st_size, base_filename);
+	file_size = strcpy((char *)buff+3, name) + strlen(name) + 1;
+	sprintf(file_size, "%d ", (int) size);
+	printf("Flashing %u bytes from file %s ... \n", size, name);
 	ymodem_send_packet(buff);
 
-	t=0;
 	/* data packets */
-	while (1) {
+	for (off = 0; off < size; off += 1024) {
 		memset(buff, 0, sizeof(buff));
-		if (read(fd, buff+3, 1024) <= 0)
-			break;
+		r = (size - off > 1024) ? 1024 : size - off;
+		memcpy(buff+3, data + off, r);
+		metrics_add_bytes(r);
 		buff[0] = STX;
 		buff[1] = ++pkt_cnt;
 		ymodem_send_packet(buff);
-		printf("\rWriting %u (%u %%)...", t,
-			t * 100 / (int) s.st_size + 1);
-		t+=1024;
+		printf("\rWriting %u (%u %%)...", off,
+			off * 100 / size + 1);
 		fflush(stdout);
 	}
 
@@ -239,9 +325,176 @@ int stm32f_write_bl(char *filename)
 	buff[0] = SOH;
 	ymodem_send_packet(buff);
 	printf("\rWriting complete.          \n");
+	metrics_phase_end();
+	return 0;
+}
 
+int stm32f_write_bl(char *filename)
+{
+	struct stat s;
+	uint8_t *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+	fstat(fd, &s);
+	if ((s.st_size == 0) || ((data = mmap(NULL, s.st_size, PROT_READ,
+		MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+		printf("Cannot read file %s\n", filename);
+		exit(1);
+	}
+
+	stm32f_write_bl_data(basename(filename), data, s.st_size);
 
+	munmap(data, s.st_size);
 	close(fd);
 	return 0;
 }
 
+/*
+ * Receive one YMODEM packet into buff, which must have room for a 1029
+ * byte packet plus MAX_XFER_SIZE. Returns the packet type (SOH, STX, EOT)
+ * and -1 on timeout or on a damaged packet.
+ */
+static int ymodem_recv_packet(uint8_t *buff)
+{
+	int length = 0, got = 0, idle = 0, t;
+
+	while (1) {
+		serial_recv(buff + got, MAX_XFER_SIZE, &t);
+		if (t == 0) {
+			if (++idle == 10)
+				return -1;
+			continue;
+		}
+		idle = 0;
+		got += t;
+		if (buff[0] == EOT)
+			return EOT;
+		if ((buff[0] != SOH) && (buff[0] != STX))
+			return -1;
+		length = (buff[0] == STX) ? 1024 : 128;
+		if (got >= length + 5)
+			break;
+	}
+
+	if ((uint8_t) (buff[1] ^ buff[2]) != 0xFF)
+		return -1;
+	if (_calc_crc16(buff + 3, length) !=
+		(buff[length + 3] << 8 | buff[length + 4]))
+		return -1;
+	return buff[0];
+}
+
+static void ymodem_reply(uint8_t c)
+{
+	int t;
+	serial_send(&c, 1, &t);
+}
+
+int stm32f_read_bl(char *filename)
+{
+	uint8_t cmd[] = {0xAA, 0x01, CMD_UPLOAD_IMAGE, 0x55};
+	uint8_t buff[1029 + MAX_XFER_SIZE];
+	uint8_t pkt_cnt = 1;
+	uint32_t size, done = 0;
+	int fd, t, r, len, errors = 0;
+	char *p;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Cannot open file %s\n", filename);
+		exit(1);
+	}
+
+	stm32f_enter_bl();
+
+	metrics_phase_begin(PHASE_YMODEM);
+	printf("Requesting YMODEM upload ...\n");
+	serial_send(cmd, sizeof(cmd), &t);
+
+	/* packet 0: file name and size */
+	r = 10;
+	do {
+		if (!(r--)) {
+			printf("Failed to get YMODEM response\n");
+			exit(1);
+		}
+		ymodem_reply('C');
+	} while ((ymodem_recv_packet(buff) != SOH) || (buff[1] != 0));
+
+	p = (char *) buff + 3;
+	p += strlen(p) + 1;
+	if (sscanf(p, "%u", &size) != 1) {
+		printf("YMODEM header without file size\n");
+		exit(1);
+	}
+	printf("Reading %u bytes of %s to %s ...\n", size, buff + 3, filename);
+	ymodem_reply(ACK);
+	ymodem_reply('C');
+
+	/* data packets */
+	while (1) {
+		r = ymodem_recv_packet(buff);
+		if (r == EOT) {
+			ymodem_reply(ACK);
+			break;
+		}
+		if (r < 0) {
+			metrics_nack();
+			metrics_retry();
+			if (++errors == 10) {
+				printf("\nToo many YMODEM errors\n");
+				exit(1);
+			}
+			ymodem_reply(NAK);
+			continue;
+		}
+		errors = 0;
+
+		/* retransmission of a packet we already have */
+		if (buff[1] == (uint8_t) (pkt_cnt - 1)) {
+			ymodem_reply(ACK);
+			continue;
+		}
+		if (buff[1] != pkt_cnt) {
+			printf("\nYMODEM packet out of sequence\n");
+			exit(1);
+		}
+
+		len = (r == STX) ? 1024 : 128;
+		if (len > size - done)
+			len = size - done;
+		if (len && (write(fd, buff + 3, len) != len)) {
+			printf("\nCannot write file %s\n", filename);
+			exit(1);
+		}
+		done += len;
+		metrics_add_bytes(len);
+		pkt_cnt++;
+		ymodem_reply(ACK);
+
+		printf("\rReading %u (%u %%)...", done,
+			size ? done * 100 / size : 100);
+		fflush(stdout);
+	}
+
+	/* closing null packet 0 */
+	ymodem_reply('C');
+	if (ymodem_recv_packet(buff) == SOH)
+		ymodem_reply(ACK);
+	printf("\rReading complete.          \n");
+	metrics_phase_end();
+	close(fd);
+
+	if (done != size) {
+		printf("Received %u of %u bytes\n", done, size);
+		exit(1);
+	}
+
+	stm32f_run_app();
+	return 0;
+}
@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libusb.h>
 
 #include "flash32w.h"
@@ -44,10 +45,109 @@
 #define USB_IF		0
 #define TIMEOUT		500
 
+#define RX_XFERS	8
+#define RX_XFER_SIZE	512
+
 //#define DEBUG
 
 libusb_device_handle *devh;
 
+struct serial_ops stm32f_usb_ops = {
+	stm32f_usb_open,
+	stm32f_usb_close,
+	stm32f_usb_send,
+	stm32f_usb_recv,
+	stm32f_usb_set_baudrate,
+	stm32f_usb_sleep,
+	stm32f_usb_rx_start,
+	stm32f_usb_rx_stop,
+};
+
+struct serial_ops *serial = &stm32f_usb_ops;
+
+/* device selection, kept for the reopen after a bridge reset */
+static char *sel_port;
+static char *sel_serial;
+
+void stm32f_usb_select(char *port, char *sn)
+{
+	sel_port = port;
+	sel_serial = sn;
+}
+
+static int usb_is_bridge(libusb_device *dev)
+{
+	struct libusb_device_descriptor d;
+
+	if (libusb_get_device_descriptor(dev, &d) < 0)
+		return 0;
+	return (d.idVendor == USB_VID) &&
+		((d.idProduct == USB_PID1) || (d.idProduct == USB_PID2));
+}
+
+/* port path as used by sysfs, e.g. 1-2.3 */
+static void usb_path(libusb_device *dev, char *buff, int len)
+{
+	uint8_t ports[8];
+	int i, n, o;
+
+	o = snprintf(buff, len, "%u", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; (i < n) && (o < len); i++)
+		o += snprintf(buff + o, len - o, "%c%u", i ? '.' : '-',
+			ports[i]);
+}
+
+static int usb_serial(libusb_device *dev, libusb_device_handle *h,
+	char *buff, int len)
+{
+	struct libusb_device_descriptor d;
+
+	buff[0] = 0;
+	if ((libusb_get_device_descriptor(dev, &d) < 0) ||
+		(d.iSerialNumber == 0) ||
+		(libusb_get_string_descriptor_ascii(h, d.iSerialNumber,
+		(uint8_t *) buff, len) < 0))
+		return -1;
+	return 0;
+}
+
+/*
+ * Walk the device list once, match VID/PID and port path from the
+ * descriptors, and open only devices that are still candidates.
+ */
+static libusb_device_handle *usb_find()
+{
+	libusb_device **list;
+	libusb_device_handle *h = NULL;
+	char buff[64];
+	ssize_t n, i;
+
+	if ((n = libusb_get_device_list(NULL, &list)) < 0)
+		return NULL;
+
+	for (i = 0; (i < n) && !h; i++) {
+		if (!usb_is_bridge(list[i]))
+			continue;
+		if (sel_port) {
+			usb_path(list[i], buff, sizeof(buff));
+			if (strcmp(buff, sel_port))
+				continue;
+		}
+		if (libusb_open(list[i], &h) < 0) {
+			h = NULL;
+			continue;
+		}
+		if (sel_serial && (usb_serial(list[i], h, buff, sizeof(buff)) ||
+			strcmp(buff, sel_serial))) {
+			libusb_close(h);
+			h = NULL;
+		}
+	}
+	libusb_free_device_list(list, 1);
+	return h;
+}
+
 int stm32f_usb_open()
 {
 	int r;
@@ -57,11 +157,15 @@ int stm32f_usb_open()
 		exit(1);
 	}
 
-	if (!(devh = libusb_open_device_with_vid_pid(NULL, USB_VID, USB_PID1)))
-		if (!(devh = libusb_open_device_with_vid_pid(NULL, USB_VID, USB_PID2))) {
-			fprintf(stderr, "libusb_open_device_with_vid_pid error %d\n", r);
-			exit(1);
-		}
+	if (!(devh = usb_find())) {
+		fprintf(stderr, "No STM32F interface found");
+		if (sel_port)
+			fprintf(stderr, " at port %s", sel_port);
+		if (sel_serial)
+			fprintf(stderr, " with serial %s", sel_serial);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
 
 	if (libusb_claim_interface(devh, USB_IF) < 0) {
 		fprintf(stderr, "usb_claim_interface error %d\n", r);
@@ -71,6 +175,43 @@ int stm32f_usb_open()
 	return 0;
 }
 
+int stm32f_usb_list()
+{
+	struct libusb_device_descriptor d;
+	libusb_device **list;
+	libusb_device_handle *h;
+	char path[64], sn[64];
+	ssize_t n, i;
+
+	if (libusb_init(NULL) < 0) {
+		fprintf(stderr, "failed to init libusb\n");
+		exit(1);
+	}
+	if ((n = libusb_get_device_list(NULL, &list)) < 0) {
+		fprintf(stderr, "failed to get USB device list\n");
+		exit(1);
+	}
+
+	printf("%-16s %-10s %s\n", "Port", "ID", "Serial");
+	for (i = 0; i < n; i++) {
+		if (!usb_is_bridge(list[i]))
+			continue;
+		libusb_get_device_descriptor(list[i], &d);
+		usb_path(list[i], path, sizeof(path));
+		strcpy(sn, "-");
+		if (libusb_open(list[i], &h) == 0) {
+			if (usb_serial(list[i], h, sn, sizeof(sn)))
+				strcpy(sn, "-");
+			libusb_close(h);
+		}
+		printf("%-16s %04x:%04x  %s\n", path, d.idVendor, d.idProduct,
+			sn);
+	}
+	libusb_free_device_list(list, 1);
+	libusb_exit(NULL);
+	return 0;
+}
+
 int stm32f_usb_close()
 {
 	libusb_release_interface(devh, USB_IF);
@@ -89,6 +230,7 @@ int stm32f_usb_send(uint8_t *data, int length, int *transfered)
 	printf("\n");
 #endif
 	libusb_bulk_transfer(devh, EP_OUT, data, length, transfered, TIMEOUT);
+	metrics_usb_xfer(*transfered);
 
 	return 0;
 }
@@ -100,6 +242,7 @@ int stm32f_usb_recv(uint8_t *data, int length, int *transfered)
 #endif
 
 	libusb_bulk_transfer(devh, EP_IN, data, length, transfered, TIMEOUT);
+	metrics_usb_xfer(*transfered);
 
 #ifdef DEBUG
 	printf("%s: bulk read %i bytes\t", __func__, *transfered);
@@ -119,7 +262,78 @@ int stm32f_usb_set_baudrate(uint32_t b)
 
 	/* CDC ACM SET_LINE_CODING */
 	libusb_control_transfer(devh, 0x21, 0x20, 0, 0,(uint8_t *) &cmd, 7, TIMEOUT);
+	metrics_usb_xfer(7);
 	/* CDC ACM SET_CONTROL_LINE_STATE */
 	libusb_control_transfer(devh, 0x21, 0x22, 0x03, 0, NULL, 0, TIMEOUT);
+	metrics_usb_xfer(0);
+	return 0;
+}
+
+int stm32f_usb_sleep(uint32_t usec)
+{
+	return usleep(usec);
+}
+
+/* streaming receive: several bulk reads stay queued on an event thread */
+static struct libusb_transfer *rx_xfers[RX_XFERS];
+static serial_rx_cb rx_cb;
+static pthread_t rx_thread;
+static volatile int rx_stopping;
+static int rx_in_flight;
+
+static void stm32f_usb_rx_done(struct libusb_transfer *xfer)
+{
+	if ((xfer->status == LIBUSB_TRANSFER_COMPLETED) && xfer->actual_length)
+		rx_cb(xfer->buffer, xfer->actual_length);
+
+	if (rx_stopping || (xfer->status == LIBUSB_TRANSFER_NO_DEVICE) ||
+		libusb_submit_transfer(xfer)) {
+		/* the stream has ended once no read is queued any more */
+		if (!__atomic_sub_fetch(&rx_in_flight, 1, __ATOMIC_ACQ_REL) &&
+			!rx_stopping)
+			rx_cb(NULL, -1);
+	}
+}
+
+static void *stm32f_usb_rx_thread(void *arg)
+{
+	struct timeval tv = {0, 100000};
+
+	while (__atomic_load_n(&rx_in_flight, __ATOMIC_ACQUIRE))
+		libusb_handle_events_timeout(NULL, &tv);
+	return NULL;
+}
+
+int stm32f_usb_rx_start(serial_rx_cb cb)
+{
+	static uint8_t bufs[RX_XFERS][RX_XFER_SIZE];
+	int i;
+
+	rx_cb = cb;
+	rx_stopping = 0;
+	for (i = 0; i < RX_XFERS; i++) {
+		rx_xfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(rx_xfers[i], devh, EP_IN, bufs[i],
+			RX_XFER_SIZE, stm32f_usb_rx_done, NULL, 0);
+		if (libusb_submit_transfer(rx_xfers[i]))
+			return -1;
+		rx_in_flight++;
+	}
+
+	if (pthread_create(&rx_thread, NULL, stm32f_usb_rx_thread, NULL))
+		return -1;
+	return 0;
+}
+
+int stm32f_usb_rx_stop()
+{
+	int i;
+
+	rx_stopping = 1;
+	for (i = 0; i < RX_XFERS; i++)
+		libusb_cancel_transfer(rx_xfers[i]);
+	pthread_join(rx_thread, NULL);
+	for (i = 0; i < RX_XFERS; i++)
+		libusb_free_transfer(rx_xfers[i]);
 	return 0;
 }
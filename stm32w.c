@@ -35,6 +35,18 @@
 #include <stdint.h>
 
 #include "flash32w.h"
+
+#define BL_ACK	0x79
+#define BL_NACK	0x1F
+
+static int bl_ack(uint8_t *buff, int t)
+{
+	if ((t == 1) && (buff[0] == BL_ACK))
+		return 0;
+	if ((t >= 1) && (buff[0] == BL_NACK))
+		metrics_nack();
+	return -1;
+}
 	
 int stm32w_reset()
 {
@@ -43,14 +55,36 @@ int stm32w_reset()
 	r |= stm32f_cmd_2_1(CMD_SET_nBOOTMODE ,1, &x);
 	r |= stm32f_cmd_2_1(CMD_SET_nRESET, 0, &x);
 	r |= stm32f_cmd_2_1(CMD_SET_nBOOTMODE, 0, &x);
-	usleep(100000);
+	serial_sleep(100000);
 	r |= stm32f_cmd_2_1(CMD_SET_nRESET, 1,  &x);
-	usleep(100000);
+	serial_sleep(100000);
 	r |= stm32f_cmd_2_1(CMD_SET_nBOOTMODE , 1, &x);
 
 	return r;
 }
 
+int stm32w_run()
+{
+	int r = 0;
+	uint8_t x;
+	r |= stm32f_cmd_2_1(CMD_SET_nBOOTMODE, 1, &x);
+	r |= stm32f_cmd_2_1(CMD_SET_nRESET, 0, &x);
+	serial_sleep(10000);
+	r |= stm32f_cmd_2_1(CMD_SET_nRESET, 1, &x);
+
+	return r;
+}
+
+/* reset the STM32W into its bootloader and sync to it */
+int stm32w_enter_bl()
+{
+	metrics_phase_begin(PHASE_RESET);
+	serial_set_baudrate(50);
+	stm32w_reset();
+	serial_set_baudrate(115200);
+	return stm32w_bl_ping();
+}
+
 int stm32w_bl_ping()
 {
 	uint8_t x = 0x7F;
@@ -98,61 +132,87 @@ int stm32w_bl_getid(uint16_t *id)
 	return 0;
 }
 
-int stm32w_bl_write_mem(uint32_t addr, uint8_t *data, int len)
+int stm32w_bl_write_prepare(struct write_frame *f, uint32_t addr,
+	uint8_t *data, int len)
 {
-	uint8_t cmd[] = {0x31, 0xCE};
-	uint8_t buff[MAX_XFER_SIZE];
 	uint8_t checksum;
-	int i,t;
-	
+	int i;
+
 	if((len>256) || (len<1))
 		return -1;
 
-	/* Send read command */
+	f->addr = addr;
+	f->len = len;
+
+	/* Start address + XOR checksum */
+	f->addr_frame[0] = addr >> 24;
+	f->addr_frame[1] = (addr >> 16) & 0xFF; 
+	f->addr_frame[2] = (addr >>  8) & 0xFF; 
+	f->addr_frame[3] = addr & 0xFF; 
+	f->addr_frame[4] = f->addr_frame[0] ^ f->addr_frame[1] ^
+		f->addr_frame[2] ^ f->addr_frame[3];
+
+	/* Length  + data + XOR checksum */
+	f->data_frame[0] = (uint8_t) len - 1;
+	checksum = (uint8_t) len - 1;
+	for(i=1;i<len+1;i++) {
+		f->data_frame[i]=data[i-1];
+		checksum = checksum ^ f->data_frame[i];
+	}
+	f->data_frame[len+1] = checksum;
+	return 0;
+}
+
+int stm32w_bl_write_frame(struct write_frame *f)
+{
+	uint8_t cmd[] = {0x31, 0xCE};
+	uint8_t buff[MAX_XFER_SIZE];
+	int t;
+#ifdef DEBUG	
+	int i;
+#endif
+
+	/* Send write command */
 	serial_send(cmd, sizeof(cmd), &t);
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 		return -1;
 
 	/* Send start address + XOR checksum */
-	buff[0] = addr >> 24;
-	buff[1] = (addr >> 16) & 0xFF; 
-	buff[2] = (addr >>  8) & 0xFF; 
-	buff[3] = addr & 0xFF; 
-	buff[4] = buff[0] ^ buff[1] ^ buff[2] ^ buff[3];
-	serial_send(buff, 5, &t);
+	serial_send(f->addr_frame, 5, &t);
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 		return -1;
 
-	/* Send length  + XOR checksum */
-	buff[0] = (uint8_t) len - 1;
-	checksum = (uint8_t) len - 1;
-	for(i=1;i<len+1;i++) {
-		buff[i]=data[i-1];
-		checksum = checksum ^ buff[i];
-	}
-	buff[len+1] = checksum;
-
 #ifdef DEBUG	
-	for(i=0;i<len+2;i++)
-		printf("%02x ", buff[i]);
+	for(i=0;i<f->len+2;i++)
+		printf("%02x ", f->data_frame[i]);
 	printf("\n");
 #endif
 
-	serial_send(buff, len+2, &t);
+	/* Send length + data + XOR checksum */
+	serial_send(f->data_frame, f->len+2, &t);
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 			return -1;
 	return 0;
 }
 
+int stm32w_bl_write_mem(uint32_t addr, uint8_t *data, int len)
+{
+	struct write_frame f;
+
+	if (stm32w_bl_write_prepare(&f, addr, data, len))
+		return -1;
+	return stm32w_bl_write_frame(&f);
+}
+
 int stm32w_bl_read_mem(uint32_t addr, uint8_t *data, uint8_t len)
 {
 	uint8_t cmd[] = {0x11, 0xEE};
@@ -167,7 +227,7 @@ int stm32w_bl_read_mem(uint32_t addr, uint8_t *data, uint8_t len)
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 		return -1;
 
 	/* Send start address + XOR checksum */
@@ -180,7 +240,7 @@ int stm32w_bl_read_mem(uint32_t addr, uint8_t *data, uint8_t len)
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 		return -1;
 
 	/* Send length  + XOR checksum */
@@ -207,34 +267,67 @@ int stm32w_bl_read_mem(uint32_t addr, uint8_t *data, uint8_t len)
 	return 0;
 }
 
+int stm32w_read(uint32_t addr, uint8_t *data, uint32_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		n = (len > 96) ? 96 : len;
+		if (stm32w_bl_read_mem(addr, data, n))
+			return -1;
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
 int stm32w_bl_erase(uint8_t start, uint8_t num)
+{
+	uint8_t pages[FLASH_PAGES];
+	int i;
+
+	if((start > FLASH_PAGES))
+		return -1;
+
+	if((num > FLASH_PAGES) || (num == 0))
+		return -1;
+
+	if (start + num > FLASH_PAGES)
+		return -1;
+
+	for (i=0;i<num;i++)
+		pages[i] = start + i;
+
+	return stm32w_bl_erase_pages(pages, num);
+}
+
+int stm32w_bl_erase_pages(uint8_t *pages, int num)
 {
 	uint8_t cmd[] = {0x43, 0xBC};
 	uint8_t buff[MAX_XFER_SIZE];
 	uint8_t checksum;
 	int i,t;
-	
-	if((start > 116))
-		return -1;
 
-	if((num > 116) || (num == 0))
+	if((num > FLASH_PAGES) || (num == 0))
 		return -1;
 
-	if (start + num > 116)
-		return -1;
+	for (i=0;i<num;i++)
+		if (pages[i] >= FLASH_PAGES)
+			return -1;
 
 	/* Send read command */
 	serial_send(cmd, sizeof(cmd), &t);
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 			return -1;
 
 	buff[0]=num-1;
 	checksum = num-1;
 	for (i=1;i<num+1;i++) {
-		buff[i]=start + i - 1;
+		buff[i]=pages[i-1];
 		checksum = checksum ^ buff[i];
 	}
 	buff[num+1] = checksum;
@@ -243,9 +336,7 @@ int stm32w_bl_erase(uint8_t start, uint8_t num)
 	serial_recv(buff, MAX_XFER_SIZE, &t);
 
 	/* Device should reply with 0x79 */
-	if ((t != 1) || (buff[0] != 0x79))
+	if (bl_ack(buff, t))
 			return -1;
 	return 0;
 }
-
-
@@ -0,0 +1,244 @@
+/*-
+ * Copyright (c) 2012 Damjan Marion
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <libgen.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+
+#include "flash32w.h"
+
+/* what we believe is in flash, and the image to be programmed */
+static uint8_t flashed[FLASH_SIZE];
+static uint8_t next[FLASH_SIZE];
+static uint32_t flashed_size;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int load_image(uint32_t addr, char *filename, uint32_t *size)
+{
+	struct stat s;
+	int fd, r;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	fstat(fd, &s);
+	if ((s.st_size > FLASH_SIZE) || !plan_fits(addr, s.st_size)) {
+		printf("Image does not fit into flash at 0x%08x\n", addr);
+		close(fd);
+		return -1;
+	}
+
+	memset(next, 0xFF, FLASH_SIZE);
+	r = read(fd, next + addr - FLASH_BASE, s.st_size);
+	close(fd);
+	if (r != s.st_size)
+		return -1;
+	*size = s.st_size;
+	return 0;
+}
+
+/* Program pages of next which differ from flashed, all pages if full */
+static int program(uint32_t addr, uint32_t size, int full)
+{
+	struct flash_plan p;
+	uint32_t first, last, pg, off;
+	double t = now();
+	int i, nblocks = 0;
+
+	/* pages covered by the old or the new image */
+	first = (addr - FLASH_BASE) / FLASH_PAGE_SIZE;
+	last = (addr - FLASH_BASE + ((size > flashed_size) ? size :
+		flashed_size) - 1) / FLASH_PAGE_SIZE;
+
+	plan_init(&p);
+	for (pg = first; pg <= last; pg++)
+		if (full || memcmp(next + pg * FLASH_PAGE_SIZE,
+			flashed + pg * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE))
+			plan_add_page(&p, pg);
+
+	if (p.npages == 0) {
+		printf("Image unchanged.\n");
+		return 0;
+	}
+
+	stm32w_enter_bl();
+
+	metrics_phase_begin(PHASE_ERASE);
+	printf("Erasing flash pages ");
+	plan_print_pages(&p);
+	printf(" ...");
+	fflush(stdout);
+	if (plan_erase(&p)) {
+		printf("Failed to erase flash.\n");
+		return -1;
+	}
+	memset(flashed + first * FLASH_PAGE_SIZE, 0xFF,
+		(last - first + 1) * FLASH_PAGE_SIZE);
+
+	metrics_phase_begin(PHASE_WRITE);
+	for (i = 0; i < p.npages; i++) {
+		for (off = p.pages[i] * FLASH_PAGE_SIZE;
+			off < (p.pages[i] + 1) * FLASH_PAGE_SIZE;
+			off += WRITE_BLOCK_SIZE) {
+			if (plan_block_empty(next + off))
+				continue;
+			if (stm32w_bl_write_mem(FLASH_BASE + off, next + off,
+				WRITE_BLOCK_SIZE)) {
+				printf("\nFailed to write block to address 0x%08x\n",
+					FLASH_BASE + off);
+				return -1;
+			}
+			metrics_add_bytes(WRITE_BLOCK_SIZE);
+			nblocks++;
+		}
+	}
+	metrics_phase_end();
+
+	memcpy(flashed, next, FLASH_SIZE);
+	flashed_size = size;
+
+	serial_set_baudrate(50);
+	stm32w_run();
+	printf(", %i blocks written, application started (%.0f ms).\n",
+		nblocks, (now() - t) * 1e3);
+	return 0;
+}
+
+#ifdef __linux__
+static int watch_init(char *filename)
+{
+	char dir[1024];
+	int fd;
+
+	strncpy(dir, filename, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+
+	/* watch the directory, build tools often replace the file */
+	fd = inotify_init();
+	if ((fd < 0) || (inotify_add_watch(fd, dirname(dir),
+		IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+		printf("Cannot watch %s\n", filename);
+		exit(1);
+	}
+	return fd;
+}
+
+static void watch_wait(int fd, char *filename)
+{
+	char buff[4096], name[1024], *base;
+	struct inotify_event *ev;
+	int n, off;
+
+	strncpy(name, filename, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	base = basename(name);
+
+	while (1) {
+		n = read(fd, buff, sizeof(buff));
+		if (n <= 0) {
+			printf("Cannot watch %s\n", filename);
+			exit(1);
+		}
+		for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) (buff + off);
+			if (ev->len && !strcmp(ev->name, base))
+				return;
+		}
+	}
+}
+#else
+static int watch_init(char *filename)
+{
+	return 0;
+}
+
+static void watch_wait(int fd, char *filename)
+{
+	static struct timespec last;
+	struct stat s;
+
+	while (1) {
+		usleep(100000);
+		if (stat(filename, &s))
+			continue;
+		if ((last.tv_sec != s.st_mtimespec.tv_sec) ||
+			(last.tv_nsec != s.st_mtimespec.tv_nsec)) {
+			last = s.st_mtimespec;
+			return;
+		}
+	}
+}
+#endif
+
+int watch_app(uint32_t addr, char *filename)
+{
+	uint32_t size;
+	int fd;
+
+	fd = watch_init(filename);
+	memset(flashed, 0xFF, FLASH_SIZE);
+
+	if (load_image(addr, filename, &size)) {
+		printf("Cannot read file %s\n", filename);
+		exit(1);
+	}
+	printf("Writing %u bytes from %s to flash:\n", size, filename);
+	if (program(addr, size, 1))
+		exit(1);
+
+	while (1) {
+		printf("Watching %s for changes ...\n", filename);
+		/* stdout may be a pipe, show everything before blocking */
+		fflush(stdout);
+		watch_wait(fd, filename);
+		if (load_image(addr, filename, &size)) {
+			printf("Cannot read file %s, waiting for next change.\n",
+				filename);
+			continue;
+		}
+		printf("%s changed:\n", filename);
+		if (program(addr, size, 0))
+			exit(1);
+	}
+	return 0;
+}